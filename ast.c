@@ -15,9 +15,37 @@ struct vector *get_all_ast(void)
     return asts;
 }
 
+// kind のノードが使うフィールドまでの大きさ
+static size_t ast_size(enum ast_kind kind)
+{
+    switch (kind) {
+    case AST_VARDECL:
+        return offsetof(struct ast, lhs);
+    case AST_NUM:
+        return offsetof(struct ast, val) + sizeof(int);
+    case AST_STRING:
+        return offsetof(struct ast, string_index) + sizeof(int);
+    case AST_LVAR:
+    case AST_GVAR:
+        return offsetof(struct ast, var) + sizeof(struct var *);
+    case AST_IF:
+    case AST_WHILE:
+    case AST_FOR:
+    case AST_VLOOP:
+        return offsetof(struct ast, update) + sizeof(struct ast *);
+    case AST_BLOCK:
+    case AST_FUNCALL:
+    case AST_FUNCTION:
+    case AST_INLINE:
+        return sizeof(struct ast);
+    default:
+        return offsetof(struct ast, rhs) + sizeof(struct ast *);
+    }
+}
+
 struct ast *new_ast(enum ast_kind kind, struct type *type)
 {
-    struct ast *ast = calloc(1, sizeof(struct ast));
+    struct ast *ast = arena_alloc(ast_size(kind));
     ast->kind = kind;
     ast->type = type;
     return ast;
@@ -44,3 +72,248 @@ struct ast *new_ast_num(int val)
     ast->val = val;
     return ast;
 }
+
+// ノードの子ノードを評価順に列挙して fn を呼ぶ
+// fn には子ノードを指すポインタを渡すので、呼び出し側で子ノードを差し替えられる
+void walk_ast_children(struct ast *ast, void (*fn)(struct ast **, void *), void *arg)
+{
+    switch (ast->kind) {
+    case AST_NUM:
+    case AST_LVAR:
+    case AST_GVAR:
+    case AST_STRING:
+    case AST_VARDECL:
+        return;
+    case AST_IF:
+        fn(&ast->cond, arg);
+        fn(&ast->then, arg);
+        if (ast->els) {
+            fn(&ast->els, arg);
+        }
+        return;
+    case AST_WHILE:
+        fn(&ast->cond, arg);
+        fn(&ast->stmt, arg);
+        return;
+    case AST_FOR:
+        if (ast->init) {
+            fn(&ast->init, arg);
+        }
+        if (ast->cond) {
+            fn(&ast->cond, arg);
+        }
+        fn(&ast->stmt, arg);
+        if (ast->update) {
+            fn(&ast->update, arg);
+        }
+        return;
+    case AST_VLOOP:
+        if (ast->init) {
+            fn(&ast->init, arg);
+        }
+        fn(&ast->cond, arg);
+        fn(&ast->stmt, arg);
+        fn(&ast->update, arg);
+        fn(&ast->els, arg);
+        return;
+    case AST_BLOCK:
+    case AST_FUNCTION:
+    case AST_INLINE:
+        for (int i = 0; i < ast->stmts->size; i++) {
+            fn((struct ast **)&ast->stmts->data[i], arg);
+        }
+        return;
+    case AST_FUNCALL:
+        for (int i = 0; i < ast->params->size; i++) {
+            fn((struct ast **)&ast->params->data[i], arg);
+        }
+        return;
+    }
+
+    fn(&ast->lhs, arg);
+    if (ast->rhs) {
+        fn(&ast->rhs, arg);
+    }
+}
+
+static void find_funcall(struct ast **ast, void *found)
+{
+    if ((*ast)->kind == AST_FUNCALL) {
+        *(bool *)found = true;
+    }
+    else {
+        walk_ast_children(*ast, find_funcall, found);
+    }
+}
+
+static void find_local_addr(struct ast **ast, void *found)
+{
+    struct ast *node = *ast;
+    if ((node->kind == AST_ADDR && node->lhs->kind == AST_LVAR) || (node->kind == AST_LVAR && node->type->bt == T_ARRAY)) {
+        *(bool *)found = true;
+    }
+    else {
+        walk_ast_children(node, find_local_addr, found);
+    }
+}
+
+// ローカル変数のアドレスを取り出しうるかどうか (& や配列の参照を含むか)
+bool takes_local_addr(struct ast *ast)
+{
+    bool found = false;
+    walk_ast_children(ast, find_local_addr, &found);
+    return found;
+}
+
+static void collect_addr_taken(struct ast **ast, void *vars)
+{
+    struct ast *node = *ast;
+    if (node->kind == AST_ADDR && node->lhs->kind == AST_LVAR) {
+        vector_push_back(vars, node->lhs->var);
+    }
+    walk_ast_children(node, collect_addr_taken, vars);
+}
+
+// & でアドレスを取られるローカル変数の一覧
+// これらの変数はポインタ経由の書き込みや関数呼び出しで値が変わりうる
+struct vector *addr_taken_vars(struct ast *func)
+{
+    struct vector *vars = new_vector();
+    walk_ast_children(func, collect_addr_taken, vars);
+    return vars;
+}
+
+// 代入や関数呼び出しを含まないかどうか
+bool is_pure(struct ast *ast)
+{
+    switch (ast->kind) {
+    case AST_ASSIGN:
+    case AST_FUNCALL:
+    case AST_INLINE:
+        return false;
+    case AST_NUM:
+    case AST_LVAR:
+    case AST_GVAR:
+    case AST_STRING:
+        return true;
+    }
+    if (!is_pure(ast->lhs)) {
+        return false;
+    }
+    return !ast->rhs || is_pure(ast->rhs);
+}
+
+// 関数呼び出しを含まないかどうか
+bool is_leaf(struct ast *ast)
+{
+    bool found = false;
+    walk_ast_children(ast, find_funcall, &found);
+    return !found;
+}
+
+static void count_node(struct ast **ast, void *count)
+{
+    (*(int *)count)++;
+    walk_ast_children(*ast, count_node, count);
+}
+
+// 部分木のノード数
+int count_ast(struct ast *ast)
+{
+    int count = 1;
+    walk_ast_children(ast, count_node, &count);
+    return count;
+}
+
+// 2つの式が同じ計算を表すかどうか (副作用の有無は考えない)
+bool same_ast(struct ast *a, struct ast *b)
+{
+    if (!a || !b) {
+        return a == b;
+    }
+    if (a->kind != b->kind) {
+        return false;
+    }
+    switch (a->kind) {
+    case AST_NUM:
+        return a->val == b->val;
+    case AST_LVAR:
+    case AST_GVAR:
+        return a->var == b->var;
+    case AST_STRING:
+        return a->string_index == b->string_index;
+    case AST_ADD:
+    case AST_SUB:
+    case AST_MUL:
+    case AST_DIV:
+    case AST_EQ:
+    case AST_NE:
+    case AST_LT:
+    case AST_LE:
+    case AST_ADD_PTR:
+        return same_ast(a->lhs, b->lhs) && same_ast(a->rhs, b->rhs);
+    case AST_ADDR:
+    case AST_DEREF:
+        return same_ast(a->lhs, b->lhs);
+    }
+    return false;
+}
+
+// 変数とスコープの置き換え表 (from[i] を to[i] に置き換える)
+struct copy_map {
+    struct vector *from;
+    struct vector *to;
+};
+
+static void *map_pointer(struct copy_map *map, void *p)
+{
+    if (map->from) {
+        for (int i = 0; i < map->from->size; i++) {
+            if (map->from->data[i] == p) {
+                return map->to->data[i];
+            }
+        }
+    }
+    return p;
+}
+
+static struct vector *copy_vector(struct vector *vec)
+{
+    struct vector *copy = new_vector();
+    for (int i = 0; i < vec->size; i++) {
+        vector_push_back(copy, vec->data[i]);
+    }
+    return copy;
+}
+
+static void copy_child(struct ast **ast, void *map)
+{
+    struct ast *copy = new_ast((*ast)->kind, (*ast)->type);
+    memcpy(copy, *ast, ast_size(copy->kind));
+    switch (copy->kind) {
+    case AST_LVAR:
+    case AST_GVAR:
+        copy->var = map_pointer(map, copy->var);
+        break;
+    case AST_BLOCK:
+    case AST_FUNCTION:
+    case AST_INLINE:
+        copy->stmts = copy_vector(copy->stmts);
+        copy->scope = map_pointer(map, copy->scope);
+        break;
+    case AST_FUNCALL:
+        copy->params = copy_vector(copy->params);
+        break;
+    }
+    walk_ast_children(copy, copy_child, map);
+    *ast = copy;
+}
+
+// 部分木を複製する
+// 複製中に現れる変数とスコープのうち from に含まれるものは、対応する to のものに置き換える
+struct ast *copy_ast(struct ast *ast, struct vector *from, struct vector *to)
+{
+    struct copy_map map = {from, to};
+    copy_child(&ast, &map);
+    return ast;
+}
@@ -0,0 +1,545 @@
+#include "rehabcc.h"
+
+// ローカル変数の定数伝播と、不要になった分岐・代入の削除
+// アドレスを取られない int, char の変数について、プログラムの各点で値が定数かどうかを
+// 制御の流れに沿って求める。条件が定数の分岐は実行されない側を、return の後の文は到達しないので削除する
+
+// 式の値
+struct cp_value {
+    bool is_const;
+    long val;
+};
+
+// プログラムのある点での各変数の値
+// 到達しない点では reachable が false になる
+struct cp_state {
+    bool reachable;
+    struct cp_value *vals; // 添字は cp->vars での位置
+};
+
+// 展開された関数呼び出しの中の return が飛ぶ先の状態と、戻り値
+struct cp_inline {
+    struct cp_state *exit;
+    struct cp_value ret;
+    bool returned;
+};
+
+struct cp {
+    struct ast *func;
+    struct scope *scope;     // 着目している箇所を囲む最も内側のスコープ
+    struct vector *vars;     // 値を追跡する変数
+    struct cp_inline *inl;   // 展開された関数呼び出しの中なら、その出口
+};
+
+static struct cp_value nac = {false, 0};
+
+static struct cp_value const_value(long val)
+{
+    return (struct cp_value){true, val};
+}
+
+static int var_index(struct cp *cp, struct var *var)
+{
+    for (int i = 0; i < cp->vars->size; i++) {
+        if (cp->vars->data[i] == var) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static struct cp_state *new_state(struct cp *cp, bool reachable)
+{
+    struct cp_state *st = arena_alloc(sizeof(struct cp_state));
+    st->reachable = reachable;
+    st->vals = arena_alloc(cp->vars->size * sizeof(struct cp_value));
+    return st;
+}
+
+static struct cp_state *copy_state(struct cp *cp, struct cp_state *src)
+{
+    struct cp_state *st = new_state(cp, src->reachable);
+    memcpy(st->vals, src->vals, sizeof(struct cp_value) * cp->vars->size);
+    return st;
+}
+
+static void assign_state(struct cp *cp, struct cp_state *dst, struct cp_state *src)
+{
+    dst->reachable = src->reachable;
+    memcpy(dst->vals, src->vals, sizeof(struct cp_value) * cp->vars->size);
+}
+
+// 合流点の状態。どちらかの経路でしか定数でない変数は定数でなくなる
+static void join_state(struct cp *cp, struct cp_state *dst, struct cp_state *src)
+{
+    if (!src->reachable) {
+        return;
+    }
+    if (!dst->reachable) {
+        assign_state(cp, dst, src);
+        return;
+    }
+    for (int i = 0; i < cp->vars->size; i++) {
+        struct cp_value *a = &dst->vals[i];
+        struct cp_value *b = &src->vals[i];
+        if (!a->is_const || !b->is_const || a->val != b->val) {
+            *a = nac;
+        }
+    }
+}
+
+static bool same_state(struct cp *cp, struct cp_state *a, struct cp_state *b)
+{
+    if (a->reachable != b->reachable) {
+        return false;
+    }
+    for (int i = 0; a->reachable && i < cp->vars->size; i++) {
+        if (a->vals[i].is_const != b->vals[i].is_const || a->vals[i].val != b->vals[i].val) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool fits_int(long val)
+{
+    return INT_MIN <= val && val <= INT_MAX;
+}
+
+// 定数同士の演算。生成するコードと同じく 64 bit で計算する
+static struct cp_value fold(enum ast_kind kind, long lhs, long rhs)
+{
+    unsigned long a = lhs;
+    unsigned long b = rhs;
+    long val;
+    switch (kind) {
+    case AST_ADD:
+        val = a + b;
+        break;
+    case AST_SUB:
+        val = a - b;
+        break;
+    case AST_MUL:
+        val = a * b;
+        break;
+    case AST_DIV:
+        if (rhs == 0 || (lhs == LONG_MIN && rhs == -1)) {
+            return nac;
+        }
+        val = lhs / rhs;
+        break;
+    case AST_EQ:
+        val = lhs == rhs;
+        break;
+    case AST_NE:
+        val = lhs != rhs;
+        break;
+    case AST_LT:
+        val = lhs < rhs;
+        break;
+    case AST_LE:
+        val = lhs <= rhs;
+        break;
+    default:
+        return nac;
+    }
+    // 定数は AST_NUM で表すので int に収まらない値は扱わない
+    return fits_int(val) ? const_value(val) : nac;
+}
+
+static struct ast *new_block(struct cp *cp)
+{
+    struct ast *block = new_ast(AST_BLOCK, NULL);
+    block->scope = cp->scope;
+    block->stmts = new_vector();
+    return block;
+}
+
+static void analyze_stmts(struct cp *cp, struct vector *stmts, struct cp_state *st, bool rewrite);
+static void analyze_stmt(struct cp *cp, struct ast **ast, struct cp_state *st, bool rewrite);
+
+// 式を評価順にたどって値を求め、代入による変数の値の変化を st に反映する
+// rewrite が true なら、定数と分かった副作用のない式を AST_NUM に置き換える
+static struct cp_value eval(struct cp *cp, struct ast **ast, struct cp_state *st, bool rewrite)
+{
+    struct ast *node = *ast;
+    struct cp_value v = nac;
+
+    switch (node->kind) {
+    case AST_NUM:
+        return const_value(node->val);
+    case AST_LVAR: {
+        int i = var_index(cp, node->var);
+        if (i >= 0) {
+            v = st->vals[i];
+        }
+        break;
+    }
+    case AST_ASSIGN: {
+        struct ast *lhs = node->lhs;
+        if (lhs->kind == AST_DEREF) {
+            eval(cp, &lhs->lhs, st, rewrite);
+        }
+        v = eval(cp, &node->rhs, st, rewrite);
+        int i = lhs->kind == AST_LVAR ? var_index(cp, lhs->var) : -1;
+        if (i >= 0) {
+            // 変数の大きさに切り詰めた値が入る
+            long val = lhs->var->type->bt == T_CHAR ? (signed char)v.val : (int)v.val;
+            st->vals[i] = v.is_const ? const_value(val) : nac;
+        }
+        // 代入式の値は右辺の値
+        return v;
+    }
+    case AST_FUNCALL:
+        for (int i = 0; i < node->params->size; i++) {
+            eval(cp, (struct ast **)&node->params->data[i], st, rewrite);
+        }
+        return nac;
+    case AST_INLINE: {
+        struct cp_inline inl = {new_state(cp, false), nac, false};
+        struct cp_inline *saved = cp->inl;
+        struct scope *saved_scope = cp->scope;
+        cp->inl = &inl;
+        cp->scope = node->scope;
+        analyze_stmts(cp, node->stmts, st, rewrite);
+        cp->inl = saved;
+        cp->scope = saved_scope;
+        if (st->reachable) {
+            // return せずに末尾に達した場合、値は不定
+            inl.ret = nac;
+        }
+        join_state(cp, st, inl.exit);
+        return inl.ret;
+    }
+    case AST_ADDR:
+        if (node->lhs->kind == AST_DEREF) {
+            eval(cp, &node->lhs->lhs, st, rewrite);
+        }
+        return nac;
+    case AST_DEREF:
+        eval(cp, &node->lhs, st, rewrite);
+        return nac;
+    case AST_ADD_PTR:
+        eval(cp, &node->lhs, st, rewrite);
+        eval(cp, &node->rhs, st, rewrite);
+        return nac;
+    case AST_ADD:
+    case AST_SUB:
+    case AST_MUL:
+    case AST_DIV:
+    case AST_EQ:
+    case AST_NE:
+    case AST_LT:
+    case AST_LE: {
+        struct cp_value lhs = eval(cp, &node->lhs, st, rewrite);
+        struct cp_value rhs = eval(cp, &node->rhs, st, rewrite);
+        if (lhs.is_const && rhs.is_const) {
+            v = fold(node->kind, lhs.val, rhs.val);
+        }
+        break;
+    }
+    }
+
+    if (rewrite && v.is_const && is_pure(node)) {
+        *ast = new_ast_num(v.val);
+    }
+    return v;
+}
+
+// ループ先頭の状態を不動点まで求めてから、その状態で本体を書き換える
+// 条件が最初から偽ならループ全体を取り除く
+static void analyze_loop(struct cp *cp, struct ast **ast, struct cp_state *st, bool rewrite)
+{
+    struct ast *node = *ast;
+    struct cp_state *in = copy_state(cp, st);
+    struct cp_state *s = new_state(cp, true);
+    struct cp_value cond;
+    for (;;) {
+        assign_state(cp, s, in);
+        cond = node->cond ? eval(cp, &node->cond, s, false) : const_value(1);
+        if (cond.is_const && !cond.val) {
+            break;
+        }
+        analyze_stmt(cp, &node->stmt, s, false);
+        if (node->kind == AST_FOR && node->update && s->reachable) {
+            eval(cp, &node->update, s, false);
+        }
+        join_state(cp, s, st);
+        if (same_state(cp, s, in)) {
+            break;
+        }
+        assign_state(cp, in, s);
+    }
+
+    // ループを抜けるのは条件が偽になったとき
+    assign_state(cp, st, in);
+    cond = node->cond ? eval(cp, &node->cond, st, rewrite) : const_value(1);
+    if (cond.is_const && cond.val) {
+        st->reachable = false;
+    }
+    if (!rewrite) {
+        return;
+    }
+    if (cond.is_const && !cond.val) {
+        struct ast *block = new_block(cp);
+        if (node->kind == AST_FOR && node->init) {
+            vector_push_back(block->stmts, node->init);
+        }
+        if (node->cond && !is_pure(node->cond)) {
+            vector_push_back(block->stmts, node->cond);
+        }
+        *ast = block;
+        return;
+    }
+    assign_state(cp, s, in);
+    if (node->cond) {
+        eval(cp, &node->cond, s, false);
+    }
+    analyze_stmt(cp, &node->stmt, s, true);
+    if (node->kind == AST_FOR && node->update && s->reachable) {
+        eval(cp, &node->update, s, true);
+    }
+}
+
+// ベクトル化したループは形を変えずに残し、中で代入される変数を定数でないものとする
+static void forget_assigned(struct ast **ast, void *arg)
+{
+    struct cp *cp = ((void **)arg)[0];
+    struct cp_state *st = ((void **)arg)[1];
+    struct ast *node = *ast;
+    if (node->kind == AST_ASSIGN && node->lhs->kind == AST_LVAR) {
+        int i = var_index(cp, node->lhs->var);
+        if (i >= 0) {
+            st->vals[i] = nac;
+        }
+    }
+    walk_ast_children(node, forget_assigned, arg);
+}
+
+static void analyze_stmt(struct cp *cp, struct ast **ast, struct cp_state *st, bool rewrite)
+{
+    struct ast *node = *ast;
+    switch (node->kind) {
+    case AST_BLOCK: {
+        struct scope *saved = cp->scope;
+        cp->scope = node->scope;
+        analyze_stmts(cp, node->stmts, st, rewrite);
+        cp->scope = saved;
+        return;
+    }
+    case AST_IF: {
+        struct cp_value cond = eval(cp, &node->cond, st, rewrite);
+        if (cond.is_const) {
+            struct ast **taken = cond.val ? &node->then : &node->els;
+            if (*taken) {
+                analyze_stmt(cp, taken, st, rewrite);
+            }
+            if (rewrite) {
+                // 条件の副作用は残す
+                struct ast *block = new_block(cp);
+                if (!is_pure(node->cond)) {
+                    vector_push_back(block->stmts, node->cond);
+                }
+                if (*taken) {
+                    vector_push_back(block->stmts, *taken);
+                }
+                *ast = block;
+            }
+            return;
+        }
+        struct cp_state *then = copy_state(cp, st);
+        analyze_stmt(cp, &node->then, then, rewrite);
+        if (node->els) {
+            analyze_stmt(cp, &node->els, st, rewrite);
+        }
+        join_state(cp, st, then);
+        return;
+    }
+    case AST_WHILE:
+        analyze_loop(cp, ast, st, rewrite);
+        return;
+    case AST_FOR:
+        if (node->init) {
+            eval(cp, &node->init, st, rewrite);
+        }
+        analyze_loop(cp, ast, st, rewrite);
+        return;
+    case AST_VLOOP: {
+        if (node->init) {
+            eval(cp, &node->init, st, rewrite);
+        }
+        void *arg[] = {cp, st};
+        walk_ast_children(node, forget_assigned, arg);
+        return;
+    }
+    case AST_RETURN: {
+        struct cp_value v = node->lhs ? eval(cp, &node->lhs, st, rewrite) : nac;
+        if (cp->inl) {
+            struct cp_inline *inl = cp->inl;
+            if (!inl->returned) {
+                inl->ret = v;
+            }
+            else if (!v.is_const || !inl->ret.is_const || v.val != inl->ret.val) {
+                inl->ret = nac;
+            }
+            inl->returned = true;
+            join_state(cp, inl->exit, st);
+        }
+        st->reachable = false;
+        return;
+    }
+    case AST_VARDECL:
+        return;
+    }
+    eval(cp, ast, st, rewrite);
+}
+
+// 文の並びをたどる。到達しなくなった以降の文は取り除く
+static void analyze_stmts(struct cp *cp, struct vector *stmts, struct cp_state *st, bool rewrite)
+{
+    for (int i = 0; i < stmts->size; i++) {
+        if (!st->reachable) {
+            if (rewrite) {
+                stmts->size = i;
+            }
+            return;
+        }
+        analyze_stmt(cp, (struct ast **)&stmts->data[i], st, rewrite);
+    }
+}
+
+// 定数伝播と、実行されない分岐・到達しない文の削除
+void propagate_constants(void)
+{
+    struct vector *funcs = get_all_ast();
+    for (int i = 0; i < funcs->size; i++) {
+        struct cp cp = {funcs->data[i]};
+        cp.scope = cp.func->scope;
+        cp.vars = new_vector();
+        struct vector *addr_taken = addr_taken_vars(cp.func);
+        for (struct var *var = cp.func->locals; var; var = var->next) {
+            bool escaped = false;
+            for (int j = 0; j < addr_taken->size; j++) {
+                escaped |= addr_taken->data[j] == var;
+            }
+            if ((var->type->bt == T_INT || var->type->bt == T_CHAR) && !escaped) {
+                vector_push_back(cp.vars, var);
+            }
+        }
+        // 関数の入口ではどの変数の値も分からない
+        analyze_stmts(&cp, cp.func->stmts, new_state(&cp, true), true);
+    }
+}
+
+// 読み出されない変数への代入の削除
+
+struct dse {
+    struct vector *read;       // 値を読み出される変数
+    struct vector *addr_taken; // アドレスを取られうるローカル変数
+    bool changed;
+};
+
+static void collect_reads(struct ast **ast, void *arg)
+{
+    struct dse *d = arg;
+    struct ast *node = *ast;
+    if (node->kind == AST_LVAR && !vector_contains(d->read, node->var)) {
+        vector_push_back(d->read, node->var);
+    }
+    if (node->kind == AST_ASSIGN && node->lhs->kind == AST_LVAR) {
+        // 代入先は読み出しではない
+        collect_reads(&node->rhs, arg);
+        return;
+    }
+    walk_ast_children(node, collect_reads, arg);
+}
+
+// 実行しても何も起きない文 (副作用のない式文、空のブロック、変数宣言) かどうか
+static bool has_no_effect(struct ast *stmt)
+{
+    switch (stmt->kind) {
+    case AST_VARDECL:
+        return true;
+    case AST_BLOCK:
+        return stmt->stmts->size == 0;
+    case AST_RETURN:
+    case AST_IF:
+    case AST_WHILE:
+    case AST_FOR:
+    case AST_VLOOP:
+        return false;
+    }
+    return is_pure(stmt);
+}
+
+static void remove_no_effect_stmts(struct dse *d, struct vector *stmts)
+{
+    int n = 0;
+    for (int i = 0; i < stmts->size; i++) {
+        struct ast *stmt = stmts->data[i];
+        if (has_no_effect(stmt)) {
+            d->changed = true;
+            continue;
+        }
+        stmts->data[n++] = stmt;
+    }
+    stmts->size = n;
+}
+
+static void remove_stores(struct ast **ast, void *arg)
+{
+    struct dse *d = arg;
+    struct ast *node = *ast;
+
+    if (node->kind == AST_VLOOP) {
+        // ベクトル化したループは形を変えずに残す
+        if (node->init) {
+            remove_stores(&node->init, arg);
+        }
+        remove_stores(&node->els, arg);
+        return;
+    }
+
+    walk_ast_children(node, remove_stores, arg);
+
+    switch (node->kind) {
+    case AST_ASSIGN:
+        if (node->lhs->kind == AST_LVAR && !vector_contains(d->read, node->lhs->var) && !vector_contains(d->addr_taken, node->lhs->var)) {
+            // 代入式の値は右辺の値なので、右辺だけを残す
+            *ast = node->rhs;
+            d->changed = true;
+        }
+        return;
+    case AST_BLOCK:
+        remove_no_effect_stmts(d, node->stmts);
+        return;
+    case AST_INLINE: {
+        remove_no_effect_stmts(d, node->stmts);
+        // 定数などを返すだけになった呼び出しは、その式に置き換える
+        if (node->stmts->size == 1) {
+            struct ast *stmt = node->stmts->data[0];
+            if (stmt->kind == AST_RETURN && stmt->lhs && is_pure(stmt->lhs)) {
+                *ast = stmt->lhs;
+                d->changed = true;
+            }
+        }
+        return;
+    }
+    }
+}
+
+void eliminate_dead_stores(void)
+{
+    struct vector *funcs = get_all_ast();
+    for (int i = 0; i < funcs->size; i++) {
+        struct ast *func = funcs->data[i];
+        struct dse d = {NULL, addr_taken_vars(func)};
+        do {
+            d.read = new_vector();
+            d.changed = false;
+            walk_ast_children(func, collect_reads, &d);
+            walk_ast_children(func, remove_stores, &d);
+            remove_no_effect_stmts(&d, func->stmts);
+        } while (d.changed);
+    }
+}
@@ -0,0 +1,416 @@
+#include "rehabcc.h"
+
+// 基本ブロック内の値番号付けによる共通部分式の削除
+// 式の値ごとに番号を付け、同じ番号の値を2回目以降に計算する箇所は、
+// その値を保持している変数か、最初に計算した箇所で保存した一時変数の読み出しに置き換える
+
+// 値番号の付いた値。値番号は values での添字
+struct value {
+    enum ast_kind kind;
+    int lhs;         // 被演算子の値番号
+    int rhs;
+    int val;         // 定数の値、読み出す大きさ、ポインタの加算の要素の大きさ
+    struct var *var; // 変数の初期値、変数のアドレス、メモリ上の変数の読み出し
+    int epoch;       // メモリから読み出す値は、読み出した時点のメモリの世代を区別する
+    bool opaque;     // 他のどの値とも等しくない (関数の戻り値など)
+};
+
+// 変数が現在保持している値
+struct binding {
+    struct var *var;
+    int vn;
+};
+
+// 値を最初に計算した箇所
+// 2回目に使うときに、この箇所を一時変数への代入に書き換える
+struct site {
+    int vn;
+    struct ast **ast;
+    struct scope *scope;
+    struct var *temp;
+};
+
+struct cse {
+    struct ast *func;
+    struct scope *scope;       // 着目している箇所を囲む最も内側のスコープ
+    struct vector *addr_taken; // アドレスを取られうるローカル変数
+    struct vector *values;     // struct value *
+    struct vector *bindings;   // struct binding *
+    struct vector *sites;      // struct site *
+    int epoch;                 // ポインタ経由の書き込みや関数呼び出しで進める
+};
+
+static int process(struct cse *c, struct ast **ast);
+static void process_stmt(struct cse *c, struct ast **ast);
+
+// 基本ブロックの境界で、それまでに分かった値をすべて忘れる
+static void reset(struct cse *c)
+{
+    c->values = new_vector();
+    c->bindings = new_vector();
+    c->sites = new_vector();
+}
+
+static int intern(struct cse *c, struct value v)
+{
+    for (int i = 0; !v.opaque && i < c->values->size; i++) {
+        struct value *w = c->values->data[i];
+        if (!w->opaque && w->kind == v.kind && w->lhs == v.lhs && w->rhs == v.rhs && w->val == v.val && w->var == v.var && w->epoch == v.epoch) {
+            return i;
+        }
+    }
+    struct value *w = arena_alloc(sizeof(struct value));
+    *w = v;
+    vector_push_back(c->values, w);
+    return c->values->size - 1;
+}
+
+static int new_opaque(struct cse *c)
+{
+    return intern(c, (struct value){.opaque = true});
+}
+
+// スコープ scope を抜けた後は、その中の変数 (一時変数を含む) の領域は兄弟のスコープの変数と共有されうる
+// そこに置いた値は読めないので、変数の値を他と等しくない値にし、そこで計算した箇所も一時変数の置き場所に使わない
+static void close_scope(struct cse *c, struct scope *scope)
+{
+    for (int i = 0; i < c->bindings->size; i++) {
+        struct binding *b = c->bindings->data[i];
+        if (vector_contains(scope->vars, b->var)) {
+            b->vn = new_opaque(c);
+        }
+    }
+    struct vector *sites = new_vector();
+    for (int i = 0; i < c->sites->size; i++) {
+        struct site *s = c->sites->data[i];
+        if (s->scope != scope) {
+            vector_push_back(sites, s);
+        }
+    }
+    c->sites = sites;
+}
+
+static struct binding *find_binding(struct cse *c, struct var *var)
+{
+    for (int i = 0; i < c->bindings->size; i++) {
+        struct binding *b = c->bindings->data[i];
+        if (b->var == var) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void bind(struct cse *c, struct var *var, int vn)
+{
+    struct binding *b = find_binding(c, var);
+    if (!b) {
+        b = arena_alloc(sizeof(struct binding));
+        b->var = var;
+        vector_push_back(c->bindings, b);
+    }
+    b->vn = vn;
+}
+
+// 変数の読み出しの値番号
+// アドレスを取られた変数とグローバル変数はメモリ上の値として扱う
+static int var_value(struct cse *c, struct ast *ast)
+{
+    struct var *var = ast->var;
+    if (var->type->bt == T_ARRAY) {
+        return intern(c, (struct value){AST_ADDR, .var = var});
+    }
+    if (ast->kind == AST_GVAR || vector_contains(c->addr_taken, var)) {
+        return intern(c, (struct value){ast->kind, .var = var, .epoch = c->epoch});
+    }
+    struct binding *b = find_binding(c, var);
+    if (b) {
+        return b->vn;
+    }
+    int vn = intern(c, (struct value){AST_LVAR, .var = var});
+    bind(c, var, vn);
+    return vn;
+}
+
+// 被演算子の値番号 lhs, rhs から ast の値番号を求める
+static int combine(struct cse *c, struct ast *ast, int lhs, int rhs)
+{
+    switch (ast->kind) {
+    case AST_DEREF:
+        if (ast->type->bt == T_ARRAY) {
+            // 配列は先頭要素へのポインタなので読み出さない
+            return lhs;
+        }
+        return intern(c, (struct value){AST_DEREF, lhs, .val = ast->type->nbyte, .epoch = c->epoch});
+    case AST_ADD_PTR:
+        return intern(c, (struct value){AST_ADD_PTR, lhs, rhs, .val = ast->type->ptr_to->nbyte});
+    case AST_ADD:
+    case AST_MUL:
+    case AST_EQ:
+    case AST_NE:
+        // 可換な演算は被演算子の順序をそろえる
+        if (lhs > rhs) {
+            int tmp = lhs;
+            lhs = rhs;
+            rhs = tmp;
+        }
+        return intern(c, (struct value){ast->kind, lhs, rhs});
+    case AST_SUB:
+    case AST_DIV:
+    case AST_LT:
+    case AST_LE:
+        return intern(c, (struct value){ast->kind, lhs, rhs});
+    }
+    return new_opaque(c);
+}
+
+// 副作用のない式の値番号
+static int number(struct cse *c, struct ast *ast)
+{
+    switch (ast->kind) {
+    case AST_NUM:
+        return intern(c, (struct value){AST_NUM, .val = ast->val});
+    case AST_STRING:
+        return intern(c, (struct value){AST_STRING, .val = ast->string_index});
+    case AST_LVAR:
+    case AST_GVAR:
+        return var_value(c, ast);
+    case AST_ADDR:
+        if (ast->lhs->kind == AST_DEREF) {
+            return number(c, ast->lhs->lhs);
+        }
+        return intern(c, (struct value){AST_ADDR, .var = ast->lhs->var});
+    case AST_DEREF:
+        return combine(c, ast, number(c, ast->lhs), 0);
+    case AST_ADD:
+    case AST_SUB:
+    case AST_MUL:
+    case AST_DIV:
+    case AST_EQ:
+    case AST_NE:
+    case AST_LT:
+    case AST_LE:
+    case AST_ADD_PTR:
+        return combine(c, ast, number(c, ast->lhs), number(c, ast->rhs));
+    }
+    return new_opaque(c);
+}
+
+// 再利用する価値のある計算かどうか
+static bool is_computation(struct ast *ast)
+{
+    switch (ast->kind) {
+    case AST_DEREF:
+        return ast->type->bt != T_ARRAY;
+    case AST_ADD:
+    case AST_SUB:
+    case AST_MUL:
+    case AST_DIV:
+    case AST_EQ:
+    case AST_NE:
+    case AST_LT:
+    case AST_LE:
+    case AST_ADD_PTR:
+        return true;
+    }
+    return false;
+}
+
+// 値番号 vn の値を持つ変数か、その値を最初に計算した箇所で保存した一時変数を読み出す式
+static struct ast *find_holder(struct cse *c, int vn, struct type *type)
+{
+    struct var *var = NULL;
+    for (int i = 0; i < c->bindings->size && !var; i++) {
+        struct binding *b = c->bindings->data[i];
+        if (b->vn == vn) {
+            var = b->var;
+        }
+    }
+    for (int i = 0; i < c->sites->size && !var; i++) {
+        struct site *s = c->sites->data[i];
+        if (s->vn != vn) {
+            continue;
+        }
+        if (!s->temp) {
+            struct ast *first = *s->ast;
+            s->temp = add_temp_var(c->func, s->scope, ptr_type(first->type ? first->type : int_type()));
+            struct ast *lhs = new_ast(AST_LVAR, s->temp->type);
+            lhs->var = s->temp;
+            *s->ast = new_ast_binary(AST_ASSIGN, s->temp->type, lhs, first);
+            bind(c, s->temp, vn);
+        }
+        var = s->temp;
+    }
+    if (!var) {
+        return NULL;
+    }
+    struct ast *use = new_ast(AST_LVAR, type);
+    use->var = var;
+    return use;
+}
+
+static void process_child(struct ast **ast, void *c)
+{
+    process(c, ast);
+}
+
+// 式を評価順にたどり、既に計算した値の再計算を置き換える。式の値番号を返す
+static int process(struct cse *c, struct ast **ast)
+{
+    struct ast *node = *ast;
+
+    if (is_computation(node) && is_pure(node)) {
+        int vn = number(c, node);
+        struct ast *holder = find_holder(c, vn, node->type);
+        if (holder) {
+            *ast = holder;
+            return vn;
+        }
+        walk_ast_children(node, process_child, c);
+        struct site *s = arena_alloc(sizeof(struct site));
+        s->vn = vn;
+        s->ast = ast;
+        s->scope = c->scope;
+        vector_push_back(c->sites, s);
+        return vn;
+    }
+
+    switch (node->kind) {
+    case AST_ASSIGN: {
+        struct ast *lhs = node->lhs;
+        if (lhs->kind == AST_DEREF) {
+            process(c, &lhs->lhs);
+        }
+        int vn = process(c, &node->rhs);
+        if (lhs->kind == AST_LVAR && lhs->var->type->bt != T_ARRAY && !vector_contains(c->addr_taken, lhs->var)) {
+            // 変数の大きさに切り詰められる場合は別の値になる
+            int size = node->rhs->type ? node->rhs->type->nbyte : 8;
+            bind(c, lhs->var, lhs->var->type->nbyte >= size ? vn : new_opaque(c));
+        }
+        else {
+            c->epoch++;
+        }
+        return vn;
+    }
+    case AST_FUNCALL:
+        walk_ast_children(node, process_child, c);
+        c->epoch++;
+        return new_opaque(c);
+    case AST_INLINE: {
+        // 本体に制御の流れを含むので、前後で基本ブロックを区切る
+        struct scope *saved = c->scope;
+        reset(c);
+        c->scope = node->scope;
+        for (int i = 0; i < node->stmts->size; i++) {
+            process_stmt(c, (struct ast **)&node->stmts->data[i]);
+        }
+        c->scope = saved;
+        reset(c);
+        return new_opaque(c);
+    }
+    case AST_ADDR:
+        if (node->lhs->kind == AST_DEREF) {
+            return process(c, &node->lhs->lhs);
+        }
+        return number(c, node);
+    case AST_DEREF:
+        return combine(c, node, process(c, &node->lhs), 0);
+    case AST_ADD:
+    case AST_SUB:
+    case AST_MUL:
+    case AST_DIV:
+    case AST_EQ:
+    case AST_NE:
+    case AST_LT:
+    case AST_LE:
+    case AST_ADD_PTR: {
+        int lhs = process(c, &node->lhs);
+        int rhs = process(c, &node->rhs);
+        return combine(c, node, lhs, rhs);
+    }
+    }
+    return number(c, node);
+}
+
+// 文をたどる。制御の流れが分かれる箇所で基本ブロックを区切る
+static void process_stmt(struct cse *c, struct ast **ast)
+{
+    struct ast *node = *ast;
+    switch (node->kind) {
+    case AST_BLOCK: {
+        struct scope *saved = c->scope;
+        c->scope = node->scope;
+        for (int i = 0; i < node->stmts->size; i++) {
+            process_stmt(c, (struct ast **)&node->stmts->data[i]);
+        }
+        c->scope = saved;
+        // ループの最適化で作ったブロックは外側のスコープを共有しているので、スコープは閉じない
+        if (node->scope != saved) {
+            close_scope(c, node->scope);
+        }
+        return;
+    }
+    case AST_IF:
+        process(c, &node->cond);
+        reset(c);
+        process_stmt(c, &node->then);
+        reset(c);
+        if (node->els) {
+            process_stmt(c, &node->els);
+            reset(c);
+        }
+        return;
+    case AST_WHILE:
+        reset(c);
+        process(c, &node->cond);
+        reset(c);
+        process_stmt(c, &node->stmt);
+        reset(c);
+        return;
+    case AST_FOR:
+        if (node->init) {
+            process(c, &node->init);
+        }
+        reset(c);
+        if (node->cond) {
+            process(c, &node->cond);
+            reset(c);
+        }
+        process_stmt(c, &node->stmt);
+        reset(c);
+        if (node->update) {
+            process(c, &node->update);
+            reset(c);
+        }
+        return;
+    case AST_VLOOP:
+        // ベクトル化したループ本体は決まった形のまま残す
+        reset(c);
+        process_stmt(c, &node->els);
+        reset(c);
+        return;
+    case AST_RETURN:
+        if (node->lhs) {
+            process(c, &node->lhs);
+        }
+        return;
+    case AST_VARDECL:
+        return;
+    }
+    process(c, ast);
+}
+
+// 共通部分式の削除
+void eliminate_common_subexprs(void)
+{
+    struct vector *funcs = get_all_ast();
+    for (int i = 0; i < funcs->size; i++) {
+        struct cse c = {funcs->data[i]};
+        c.scope = c.func->scope;
+        c.addr_taken = addr_taken_vars(c.func);
+        reset(&c);
+        for (int j = 0; j < c.func->stmts->size; j++) {
+            process_stmt(&c, (struct ast **)&c.func->stmts->data[j]);
+        }
+    }
+}
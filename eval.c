@@ -0,0 +1,474 @@
+#include "rehabcc.h"
+
+// 実引数がすべて定数の関数呼び出しを、コンパイル時に構文木を解釈して実行し、結果の定数に置き換える
+// 対象はグローバル変数や文字列リテラルに触れず、定義のない関数を (間接的にも) 呼ばない関数に限る
+// 実行がステップ数の上限を超えたり、未定義の動作に当たったりした呼び出しはそのまま残す
+
+// 解釈中のローカル変数を置くメモリ
+// アドレスは MEM_BASE からの下駄をはかせた値にして、0 付近のポインタを不正なアドレスとして扱う
+#define MEM_SIZE (1 << 20)
+#define MEM_BASE 0x10000
+#define MAX_CALL_DEPTH 1000
+
+// 関数定義と、解釈するときのローカル変数の配置
+struct func_info {
+    struct ast *func;
+    struct vector *callees; // struct func_info *
+    bool pure;              // コンパイル時に実行してよい
+    int nvars;              // func->locals の変数の数
+    struct var **vars;      // func->locals の変数と、フレーム先頭からのオフセット
+    int *offsets;
+    int frame_size;
+};
+
+static struct func_info *infos;
+static int ninfos;
+
+// 解釈器の状態
+struct interp {
+    char *mem;
+    int sp;                 // 確保済みのメモリの大きさ
+    long steps;             // 残りの評価ステップ数
+    int depth;              // 関数呼び出しの深さ
+    bool returning;         // return を実行し、関数 (または展開された呼び出し) から抜けるところ
+    long ret;               // return の値
+    struct func_info *func; // 実行中の関数
+    int base;               // 実行中の関数のフレームの先頭
+};
+
+static struct func_info *find_info(char *name)
+{
+    for (int i = 0; i < ninfos; i++) {
+        if (!strcmp(infos[i].func->funcname, name)) {
+            return &infos[i];
+        }
+    }
+    return NULL;
+}
+
+// 関数本体だけを見て分かる不純な操作を探し、呼び出す関数を集める
+static void check_body(struct ast **ast, void *arg)
+{
+    struct func_info *info = arg;
+    struct ast *node = *ast;
+    switch (node->kind) {
+    case AST_GVAR:
+    case AST_STRING:
+    case AST_VLOOP:
+        info->pure = false;
+        return;
+    case AST_FUNCALL: {
+        struct func_info *callee = find_info(node->funcname);
+        if (!callee || callee->func->params->size != node->params->size) {
+            info->pure = false;
+            return;
+        }
+        vector_push_back(info->callees, callee);
+        break;
+    }
+    }
+    walk_ast_children(node, check_body, arg);
+}
+
+static void layout_vars(struct func_info *info)
+{
+    for (struct var *var = info->func->locals; var; var = var->next) {
+        info->nvars++;
+    }
+    info->vars = calloc(info->nvars, sizeof(struct var *));
+    info->offsets = calloc(info->nvars, sizeof(int));
+    int i = 0;
+    for (struct var *var = info->func->locals; var; var = var->next) {
+        info->frame_size = align(info->frame_size, var->type->align);
+        info->vars[i] = var;
+        info->offsets[i] = info->frame_size;
+        info->frame_size += var->type->nbyte;
+        i++;
+    }
+    info->frame_size = align(info->frame_size, 8);
+}
+
+static void collect_infos(void)
+{
+    struct vector *funcs = get_all_ast();
+    ninfos = funcs->size;
+    infos = calloc(ninfos, sizeof(struct func_info));
+    for (int i = 0; i < ninfos; i++) {
+        infos[i].func = funcs->data[i];
+        infos[i].callees = new_vector();
+        infos[i].pure = true;
+    }
+    for (int i = 0; i < ninfos; i++) {
+        walk_ast_children(infos[i].func, check_body, &infos[i]);
+        layout_vars(&infos[i]);
+    }
+
+    // 不純な関数を呼ぶ関数も不純になる。変化がなくなるまで繰り返す
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < ninfos; i++) {
+            struct func_info *info = &infos[i];
+            for (int j = 0; info->pure && j < info->callees->size; j++) {
+                struct func_info *callee = info->callees->data[j];
+                if (!callee->pure) {
+                    info->pure = false;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static bool var_addr(struct interp *in, struct var *var, long *addr)
+{
+    struct func_info *info = in->func;
+    for (int i = 0; i < info->nvars; i++) {
+        if (info->vars[i] == var) {
+            *addr = MEM_BASE + in->base + info->offsets[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// generate.c の load と同じく、型の大きさだけ読み出して符号拡張する
+static bool load(struct interp *in, struct type *type, long addr, long *val)
+{
+    if (type->bt == T_ARRAY) {
+        *val = addr;
+        return true;
+    }
+    long i = addr - MEM_BASE;
+    if (i < 0 || in->sp - type->nbyte < i) {
+        return false;
+    }
+    switch (type->bt) {
+    case T_CHAR: {
+        signed char c;
+        memcpy(&c, in->mem + i, 1);
+        *val = c;
+        return true;
+    }
+    case T_INT: {
+        int n;
+        memcpy(&n, in->mem + i, 4);
+        *val = n;
+        return true;
+    }
+    case T_PTR:
+        memcpy(val, in->mem + i, 8);
+        return true;
+    }
+    return false;
+}
+
+static bool store(struct interp *in, struct type *type, long addr, long val)
+{
+    long i = addr - MEM_BASE;
+    if (type->bt == T_ARRAY || i < 0 || in->sp - type->nbyte < i) {
+        return false;
+    }
+    switch (type->bt) {
+    case T_CHAR: {
+        signed char c = val;
+        memcpy(in->mem + i, &c, 1);
+        return true;
+    }
+    case T_INT: {
+        int n = val;
+        memcpy(in->mem + i, &n, 4);
+        return true;
+    }
+    case T_PTR:
+        memcpy(in->mem + i, &val, 8);
+        return true;
+    }
+    return false;
+}
+
+static bool eval(struct interp *in, struct ast *node, long *val);
+static bool exec(struct interp *in, struct ast *node);
+
+static bool eval_lval(struct interp *in, struct ast *node, long *addr)
+{
+    switch (node->kind) {
+    case AST_LVAR:
+        return var_addr(in, node->var, addr);
+    case AST_DEREF:
+        return eval(in, node->lhs, addr);
+    }
+    return false;
+}
+
+static bool call(struct interp *in, struct func_info *callee, long *args, long *val)
+{
+    struct ast *func = callee->func;
+    if (!callee->pure || in->depth == MAX_CALL_DEPTH) {
+        return false;
+    }
+    int base = align(in->sp, 8);
+    if (MEM_SIZE - callee->frame_size < base) {
+        return false;
+    }
+
+    struct func_info *saved_func = in->func;
+    int saved_base = in->base;
+    int saved_sp = in->sp;
+    in->func = callee;
+    in->base = base;
+    in->sp = base + callee->frame_size;
+    in->depth++;
+    memset(in->mem + base, 0, callee->frame_size);
+
+    bool ok = true;
+    for (int i = 0; ok && i < func->params->size; i++) {
+        struct var *var = func->params->data[i];
+        long addr;
+        ok = var_addr(in, var, &addr) && store(in, var->type, addr, args[i]);
+    }
+    for (int i = 0; ok && !in->returning && i < func->stmts->size; i++) {
+        ok = exec(in, func->stmts->data[i]);
+    }
+    // return せずに本体の終わりに達すると戻り値は不定になる
+    ok = ok && in->returning;
+    *val = in->ret;
+
+    in->returning = false;
+    in->func = saved_func;
+    in->base = saved_base;
+    in->sp = saved_sp;
+    in->depth--;
+    return ok;
+}
+
+static bool eval(struct interp *in, struct ast *node, long *val)
+{
+    if (in->steps-- <= 0) {
+        return false;
+    }
+
+    switch (node->kind) {
+    case AST_NUM:
+        *val = node->val;
+        return true;
+    case AST_LVAR: {
+        long addr;
+        return var_addr(in, node->var, &addr) && load(in, node->var->type, addr, val);
+    }
+    case AST_ASSIGN: {
+        // 代入式の値は、左辺の型に切り詰める前の右辺値
+        long addr;
+        return eval_lval(in, node->lhs, &addr) && eval(in, node->rhs, val) &&
+               store(in, node->lhs->type, addr, *val);
+    }
+    case AST_ADDR:
+        return eval_lval(in, node->lhs, val);
+    case AST_DEREF: {
+        long addr;
+        return eval(in, node->lhs, &addr) && load(in, node->type, addr, val);
+    }
+    case AST_FUNCALL: {
+        long args[node->params->size + 1];
+        for (int i = 0; i < node->params->size; i++) {
+            if (!eval(in, node->params->data[i], &args[i])) {
+                return false;
+            }
+        }
+        struct func_info *callee = find_info(node->funcname);
+        return callee && call(in, callee, args, val);
+    }
+    case AST_INLINE: {
+        for (int i = 0; !in->returning && i < node->stmts->size; i++) {
+            if (!exec(in, node->stmts->data[i])) {
+                return false;
+            }
+        }
+        if (!in->returning) {
+            return false;
+        }
+        in->returning = false;
+        *val = in->ret;
+        return true;
+    }
+    case AST_ADD:
+    case AST_SUB:
+    case AST_MUL:
+    case AST_DIV:
+    case AST_EQ:
+    case AST_NE:
+    case AST_LT:
+    case AST_LE:
+    case AST_ADD_PTR:
+        break;
+    default:
+        return false;
+    }
+
+    long l, r;
+    if (!eval(in, node->lhs, &l) || !eval(in, node->rhs, &r)) {
+        return false;
+    }
+    // 実行時と同じく 64 bit で計算し、桁あふれは切り捨てる
+    switch (node->kind) {
+    case AST_ADD:
+        *val = (unsigned long)l + r;
+        return true;
+    case AST_SUB:
+        *val = (unsigned long)l - r;
+        return true;
+    case AST_MUL:
+        *val = (unsigned long)l * r;
+        return true;
+    case AST_DIV:
+        // 実行時に例外になる割り算はそのまま実行時に起こす
+        if (r == 0 || (l == LONG_MIN && r == -1)) {
+            return false;
+        }
+        *val = l / r;
+        return true;
+    case AST_EQ:
+        *val = l == r;
+        return true;
+    case AST_NE:
+        *val = l != r;
+        return true;
+    case AST_LT:
+        *val = l < r;
+        return true;
+    case AST_LE:
+        *val = l <= r;
+        return true;
+    case AST_ADD_PTR:
+        *val = (unsigned long)l + (unsigned long)r * node->type->ptr_to->nbyte;
+        return true;
+    }
+    return false;
+}
+
+static bool exec(struct interp *in, struct ast *node)
+{
+    if (in->steps-- <= 0) {
+        return false;
+    }
+
+    long val;
+    switch (node->kind) {
+    case AST_RETURN:
+        if (!eval(in, node->lhs, &in->ret)) {
+            return false;
+        }
+        in->returning = true;
+        return true;
+    case AST_IF:
+        if (!eval(in, node->cond, &val)) {
+            return false;
+        }
+        if (val) {
+            return exec(in, node->then);
+        }
+        return !node->els || exec(in, node->els);
+    case AST_WHILE:
+        for (;;) {
+            if (!eval(in, node->cond, &val)) {
+                return false;
+            }
+            if (!val) {
+                return true;
+            }
+            if (!exec(in, node->stmt)) {
+                return false;
+            }
+            if (in->returning) {
+                return true;
+            }
+        }
+    case AST_FOR:
+        if (node->init && !exec(in, node->init)) {
+            return false;
+        }
+        for (;;) {
+            if (node->cond) {
+                if (!eval(in, node->cond, &val)) {
+                    return false;
+                }
+                if (!val) {
+                    return true;
+                }
+            }
+            if (!exec(in, node->stmt)) {
+                return false;
+            }
+            if (in->returning) {
+                return true;
+            }
+            if (node->update && !exec(in, node->update)) {
+                return false;
+            }
+        }
+    case AST_BLOCK:
+        for (int i = 0; !in->returning && i < node->stmts->size; i++) {
+            if (!exec(in, node->stmts->data[i])) {
+                return false;
+            }
+        }
+        return true;
+    case AST_VARDECL:
+        return true;
+    }
+    // 式文
+    return eval(in, node, &val);
+}
+
+static bool is_constant_call(struct ast *node)
+{
+    if (node->kind != AST_FUNCALL) {
+        return false;
+    }
+    for (int i = 0; i < node->params->size; i++) {
+        struct ast *arg = node->params->data[i];
+        if (arg->kind != AST_NUM) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 内側の呼び出しから先に畳み込む (f(g(1)) では g(1) が定数になってから f を評価する)
+static void fold_calls(struct ast **ast, void *arg)
+{
+    struct interp *in = arg;
+    struct ast *node = *ast;
+    walk_ast_children(node, fold_calls, arg);
+    if (!is_constant_call(node)) {
+        return;
+    }
+    struct func_info *callee = find_info(node->funcname);
+    // ポインタを返す関数の値は解釈器のメモリを指すので畳み込めない
+    if (!callee || !callee->pure ||
+        (callee->func->type->bt != T_INT && callee->func->type->bt != T_CHAR)) {
+        return;
+    }
+
+    long args[node->params->size + 1];
+    for (int i = 0; i < node->params->size; i++) {
+        args[i] = ((struct ast *)node->params->data[i])->val;
+    }
+    in->steps = eval_limit;
+    in->sp = 0;
+    in->depth = 0;
+    long val;
+    if (call(in, callee, args, &val) && val == (int)val) {
+        *ast = new_ast_num(val);
+    }
+}
+
+void evaluate_pure_calls(void)
+{
+    collect_infos();
+    struct interp in = {calloc(1, MEM_SIZE)};
+    for (int i = 0; i < ninfos; i++) {
+        walk_ast_children(infos[i].func, fold_calls, &in);
+    }
+    free(in.mem);
+}
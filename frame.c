@@ -0,0 +1,46 @@
+#include "rehabcc.h"
+
+// 変数を整列要求の大きい順に並べ替える (宣言順を保つ挿入ソート)
+static void sort_by_align(struct vector *vars)
+{
+    for (int i = 1; i < vars->size; i++) {
+        struct var *var = vars->data[i];
+        int j = i;
+        while (j > 0 && ((struct var *)vars->data[j - 1])->type->align < var->type->align) {
+            vars->data[j] = vars->data[j - 1];
+            j--;
+        }
+        vars->data[j] = var;
+    }
+}
+
+// スコープ内の変数を offset から詰めて配置し、配置に必要な大きさを返す
+// 内側のスコープは外側の変数の後ろに置き、兄弟スコープどうしは同じ領域を使い回す
+static int layout_scope(struct scope *scope, int offset)
+{
+    sort_by_align(scope->vars);
+    for (int i = 0; i < scope->vars->size; i++) {
+        struct var *var = scope->vars->data[i];
+        if (var->reg) {
+            continue;
+        }
+        offset = align(offset + var->type->nbyte, var->type->align);
+        var->offset = offset;
+    }
+
+    int size = offset;
+    for (int i = 0; i < scope->children->size; i++) {
+        int child = layout_scope(scope->children->data[i], offset);
+        if (size < child) {
+            size = child;
+        }
+    }
+    return size;
+}
+
+// 関数のローカル変数に RBP からのオフセットを割り当て、フレームの大きさを決める
+// call 命令の時点で RSP を 16 バイト境界に揃えるため、フレームの大きさも 16 の倍数にする
+void layout_frame(struct ast *func)
+{
+    func->stack_size = align(layout_scope(func->scope, 0), 16);
+}
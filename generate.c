@@ -1,11 +1,80 @@
 #include "rehabcc.h"
 
 static char *regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+static char *regs32[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
+static char *regs8[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
+
+// 変数を置くレジスタの各幅での名前
+// clang-format off
+static char *var_regs[][3] = {
+    {"rbx", "ebx", "bl"},
+    {"r12", "r12d", "r12b"},
+    {"r13", "r13d", "r13b"},
+    {"r14", "r14d", "r14b"},
+    {"r15", "r15d", "r15b"},
+    {"rsi", "esi", "sil"},
+    {"rcx", "ecx", "cl"},
+    {"r8", "r8d", "r8b"},
+    {"r9", "r9d", "r9b"},
+    {"r10", "r10d", "r10b"},
+    {"r11", "r11d", "r11b"},
+    {NULL},
+};
+// clang-format on
+
+// System V ABI で RSP より下に確保されているレッドゾーンの大きさ
+#define RED_ZONE_SIZE 128
+
+// true の間はアセンブリを出力しない (スタックの深さを測るための空読み)
+static bool silent = false;
+
+// 関数先頭からの push による 8 バイト単位のスタックの深さと、その最大値
+static int depth;
+static int max_depth;
+
+// コード生成中の関数のフレーム
+// use_fp が false の場合は RBP を使わず RSP からの相対位置で変数にアクセスする
+// このとき関数入口の RSP を E とすると、変数は E - frame_top - offset に、
+// RSP は E - sub_size - 8 * depth にある
+static bool use_fp;
+static int frame_top;
+static int sub_size;
+static bool frame_allocated; // use_fp が false の関数で sub_size だけ RSP を下げた後かどうか
+
+// 関数入口で退避した callee-saved レジスタ
+static struct vector *saved_regs;
+
+// 展開中の関数呼び出しの出口のラベル (0 なら関数本体の直下)
+static int inline_label;
+
+// コード生成中の関数と、引数を仮引数にコピーする処理の先頭のラベル
+// 末尾呼び出しを使えない関数では start_label は 0
+static struct ast *current_func;
+static int start_label;
+
+// NULL でなければ、出力する行を関数の末尾に追い出すためにここに溜める
+static struct vector *deferred;
+
+// 関数の末尾に追い出した、めったに実行されないコードの行の並び
+static struct vector *cold_blocks;
 
 static void println(char *fmt, ...)
 {
+    if (silent) {
+        return;
+    }
     va_list ap;
     va_start(ap, fmt);
+    if (deferred) {
+        va_list aq;
+        va_copy(aq, ap);
+        int len = vsnprintf(NULL, 0, fmt, aq);
+        va_end(aq);
+        char *line = arena_alloc(len + 1);
+        vsnprintf(line, len + 1, fmt, ap);
+        vector_push_back(deferred, line);
+        return;
+    }
     vprintf(fmt, ap);
     printf("\n");
 }
@@ -17,22 +86,349 @@ static int get_label()
     return label;
 }
 
+// RSP を動かした後に、CFA (呼び出し元の RSP) が RSP からどれだけ離れているかをアンワインド情報に記録する
+// RBP を使う関数では CFA を RBP からの位置で表すので、RSP が動いても記録し直さなくてよい
+static void cfi_adjust_rsp(void)
+{
+    if (!use_fp) {
+        println("  .cfi_def_cfa_offset %d", 8 + (frame_allocated ? sub_size : 0) + 8 * depth);
+    }
+}
+
+static void push(char *arg)
+{
+    println("  push %s", arg);
+    depth++;
+    if (max_depth < depth) {
+        max_depth = depth;
+    }
+    cfi_adjust_rsp();
+}
+
+static void pop(char *reg)
+{
+    println("  pop %s", reg);
+    depth--;
+    cfi_adjust_rsp();
+}
+
+// スタックトップのアドレスから型の大きさだけ読み出し、64 bit に符号拡張する
+// 配列は先頭要素へのポインタとして扱うので、アドレスをそのまま値とする
 static void load(struct type *type)
 {
-    println("  pop rax");
+    if (type->bt == T_ARRAY) {
+        return;
+    }
+    pop("rax");
     switch (type->bt) {
     case T_CHAR:
-        println("  movsx ecx, byte ptr [rax]");
+        println("  movsx rax, byte ptr [rax]");
         break;
     case T_INT:
+        println("  movsxd rax, dword ptr [rax]");
+        break;
     case T_PTR:
         println("  mov rax, [rax]");
         break;
     }
-    println("  push rax");
+    push("rax");
+}
+
+// スタックトップの値を、その下にあるアドレスへ型の大きさだけ書き込む
+static void store(struct type *type)
+{
+    pop("rdi"); // 右辺値
+    pop("rax"); // 左辺アドレス
+    switch (type ? type->bt : T_PTR) {
+    case T_CHAR:
+        println("  mov [rax], dil");
+        break;
+    case T_INT:
+        println("  mov [rax], edi");
+        break;
+    default:
+        println("  mov [rax], rdi");
+        break;
+    }
+    push("rdi"); // 代入式の評価値は右辺値
+}
+
+// src の下位 type の大きさ分を符号拡張して、変数を置くレジスタ dst に入れる
+// メモリ上の変数に書き込んで読み出したときと同じ値にするため
+static void extend_to_reg(char *dst, char *src, struct type *type)
+{
+    int w = type->bt == T_CHAR ? 2 : type->bt == T_INT ? 1 : 0;
+    char *s = src;
+    for (int i = 0; var_regs[i][0]; i++) {
+        if (!strcmp(var_regs[i][0], src)) {
+            s = var_regs[i][w];
+        }
+    }
+    for (int i = 0; i < 6; i++) {
+        if (!strcmp(regs[i], src)) {
+            s = w == 2 ? regs8[i] : w == 1 ? regs32[i] : regs[i];
+        }
+    }
+    switch (type->bt) {
+    case T_CHAR:
+        println("  movsx %s, %s", dst, s);
+        break;
+    case T_INT:
+        println("  movsxd %s, %s", dst, s);
+        break;
+    default:
+        if (strcmp(dst, src)) {
+            println("  mov %s, %s", dst, src);
+        }
+        break;
+    }
+}
+
+// ローカル変数のアドレスを表すオペランド
+static char *local_addr(struct var *var)
+{
+    static char buf[64];
+    if (use_fp) {
+        snprintf(buf, sizeof(buf), "[rbp - %d]", var->offset);
+    }
+    else {
+        int disp = sub_size + 8 * depth - frame_top - var->offset;
+        snprintf(buf, sizeof(buf), "[rsp %c %d]", disp < 0 ? '-' : '+', abs(disp));
+    }
+    return buf;
+}
+
+// 呼び出し元の関数フレームに戻る
+// エピローグの後ろに続くコードは関数本体の途中なので、アンワインド情報をエピローグの前の状態に戻す
+static void gen_epilogue(void)
+{
+    int nsaved = saved_regs->size;
+    println("  .cfi_remember_state");
+    if (use_fp && nsaved) {
+        println("  lea rsp, [rbp - %d]", sub_size + 8 * nsaved);
+    }
+    else if (!use_fp && sub_size + 8 * (depth - nsaved)) {
+        println("  add rsp, %d", sub_size + 8 * (depth - nsaved));
+        println("  .cfi_def_cfa_offset %d", 8 + 8 * nsaved);
+    }
+    for (int i = nsaved - 1; i >= 0; i--) {
+        println("  pop %s", saved_regs->data[i]);
+        if (!use_fp) {
+            println("  .cfi_def_cfa_offset %d", 8 + 8 * i);
+        }
+    }
+    if (use_fp) {
+        println("  mov rsp, rbp");
+        println("  pop rbp");
+        println("  .cfi_def_cfa rsp, 8");
+    }
+    println("  ret");
+    println("  .cfi_restore_state");
 }
 
 static void gen(struct ast *);
+static void gen_stmt(struct ast *);
+
+// -fprofile-generate: ノードの実行回数のカウンタを増やす
+static void gen_counter(struct ast *node, int which)
+{
+    if (profile_generate && node->prof_id) {
+        println("  inc qword ptr [rip + .Lprof + %d]", 8 * (2 + 2 * (node->prof_id - 1) + which));
+    }
+}
+
+// if の then 側 (then が true) か else 側を生成する
+static void gen_branch(struct ast *node, bool then)
+{
+    if (then) {
+        gen_counter(node, PROF_TAKEN);
+        gen_stmt(node->then);
+    }
+    else {
+        gen_stmt(node->els);
+    }
+}
+
+// めったに実行されない分岐を .Lcold<label> として関数の末尾に追い出す。実行後は .Lend<label> に戻る
+// 追い出した先でもスタックの深さは変わらないので、そのまま同じ深さで生成してよい
+static void gen_cold_branch(struct ast *node, bool then, int label)
+{
+    struct vector *saved = deferred;
+    deferred = new_vector();
+    println(".Lcold%d:", label);
+    cfi_adjust_rsp();
+    gen_branch(node, then);
+    println("  jmp .Lend%d", label);
+    vector_push_back(cold_blocks, deferred);
+    deferred = saved;
+}
+
+// 実引数をすべて評価してから引数レジスタに載せる
+// 途中で評価した式がレジスタを壊すので、評価しながら載せてはいけない
+static void gen_args(struct ast *node)
+{
+    if (node->params->size > 6) {
+        // まだ6個までしか渡せない
+        error("引数が多すぎます: %s", node->funcname);
+    }
+    for (int i = 0; i < node->params->size; i++) {
+        gen(node->params->data[i]); // スタックトップに引数を評価した値が来る
+    }
+    for (int i = node->params->size - 1; i >= 0; i--) {
+        pop(regs[i]);
+    }
+}
+
+// return f(...) を、現在のフレームを再利用するジャンプとして生成する
+// 自分自身の呼び出しは仮引数を書き換えて関数の先頭に戻るループになる
+// 他の関数の場合はフレームを畳んでから飛ぶので、戻り先は自分の呼び出し元になる
+static void gen_tail_call(struct ast *node)
+{
+    gen_counter(node, PROF_ENTRY);
+    gen_args(node);
+    if (!strcmp(node->funcname, current_func->funcname)) {
+        println("  jmp .Lstart%d", start_label);
+        return;
+    }
+
+    int nsaved = saved_regs->size;
+    println("  .cfi_remember_state");
+    println("  lea rsp, [rbp - %d]", sub_size + 8 * nsaved);
+    for (int i = nsaved - 1; i >= 0; i--) {
+        println("  pop %s", saved_regs->data[i]);
+    }
+    println("  mov rsp, rbp");
+    println("  pop rbp");
+    println("  .cfi_def_cfa rsp, 8");
+    println("  mov al, 0");
+    println("  jmp %s", node->funcname);
+    println("  .cfi_restore_state");
+}
+
+// ベクトル化したループの被演算子が配列の要素 base[i] かどうか
+static bool is_vector_element(struct ast *e, struct var *iv)
+{
+    return e->kind == AST_DEREF && e->lhs->kind == AST_ADD_PTR && e->lhs->rhs->kind == AST_LVAR && e->lhs->rhs->var == iv;
+}
+
+// for (init; i < n; i = i + 1) a[i] = x op y; を、SIMD レジスタの幅の要素ずつまとめて実行する
+// 配列の先頭アドレスとループ不変な値をスタックに積み、i は rdx に置いてループする。
+// 残りの要素は元のループ (els) で処理する
+static void gen_vloop(struct ast *node)
+{
+    struct var *iv = node->update->lhs->var;
+    struct ast *stmt = node->stmt;
+    int size = stmt->lhs->type->nbyte;
+    int bytes = avx2 ? 32 : 16;
+    int width = bytes / size;
+    char *suffix = size == 1 ? "b" : "d";
+    int label = get_label();
+
+    if (node->init) {
+        gen_stmt(node->init);
+    }
+
+    // 被演算子は xmm1, xmm2 (AVX2 では ymm) に読み込み、結果は xmm0 に作る
+    struct ast *ops[2];
+    int nops = 0;
+    int op = stmt->rhs->kind;
+    if (op == AST_ADD || op == AST_SUB) {
+        ops[nops++] = stmt->rhs->lhs;
+        ops[nops++] = stmt->rhs->rhs;
+    }
+    else {
+        ops[nops++] = stmt->rhs;
+    }
+
+    // スタックには書き込み先、被演算子、上限の順に積む
+    gen(stmt->lhs->lhs->lhs);
+    for (int i = 0; i < nops; i++) {
+        gen(is_vector_element(ops[i], iv) ? ops[i]->lhs->lhs : ops[i]);
+    }
+    gen(node->cond->rhs);
+    gen(node->cond->lhs);
+    pop("rdx");
+    int nslots = nops + 2;
+    int dst = 8 * (nslots - 1);
+
+    // 書き込み先が読み出し元の少し後ろにあると、まとめて読んだ後に書くのでは結果が変わる
+    for (int i = 0; i < nops; i++) {
+        if (is_vector_element(ops[i], iv)) {
+            println("  mov rax, [rsp + %d]", dst);
+            println("  sub rax, [rsp + %d]", 8 * (nops - i));
+            println("  cmp rax, 0");
+            println("  jle .Lvcheck%d_%d", label, i);
+            println("  cmp rax, %d", bytes);
+            println("  jl .Lvend%d", label);
+            println(".Lvcheck%d_%d:", label, i);
+        }
+    }
+
+    char *reg = avx2 ? "ymm" : "xmm";
+    for (int i = 0; i < nops; i++) {
+        if (!is_vector_element(ops[i], iv)) {
+            // 全要素に同じ値を並べる
+            println("  mov rax, [rsp + %d]", 8 * (nops - i));
+            println("  movd xmm%d, eax", i + 1);
+            if (avx2) {
+                println("  vpbroadcast%s ymm%d, xmm%d", suffix, i + 1, i + 1);
+            }
+            else if (size == 1) {
+                println("  punpcklbw xmm%d, xmm%d", i + 1, i + 1);
+                println("  pshuflw xmm%d, xmm%d, 0", i + 1, i + 1);
+                println("  pshufd xmm%d, xmm%d, 0", i + 1, i + 1);
+            }
+            else {
+                println("  pshufd xmm%d, xmm%d, 0", i + 1, i + 1);
+            }
+        }
+    }
+
+    println(".Lvbegin%d:", label);
+    println("  lea rax, [rdx + %d]", width - 1);
+    println("  cmp rax, [rsp]");
+    println("  %s .Lvend%d", node->cond->kind == AST_LT ? "jge" : "jg", label);
+    for (int i = 0; i < nops; i++) {
+        if (is_vector_element(ops[i], iv)) {
+            println("  mov rax, [rsp + %d]", 8 * (nops - i));
+            println("  %smovdqu %s%d, [rax + rdx * %d]", avx2 ? "v" : "", reg, i + 1, size);
+        }
+    }
+    if (nops == 1) {
+        println("  %smovdqa %s0, %s1", avx2 ? "v" : "", reg, reg);
+    }
+    else {
+        char *insn = op == AST_ADD ? "padd" : "psub";
+        if (avx2) {
+            println("  v%s%s ymm0, ymm1, ymm2", insn, suffix);
+        }
+        else {
+            println("  movdqa xmm0, xmm1");
+            println("  %s%s xmm0, xmm2", insn, suffix);
+        }
+    }
+    println("  mov rax, [rsp + %d]", dst);
+    println("  %smovdqu [rax + rdx * %d], %s0", avx2 ? "v" : "", size, reg);
+    println("  add rdx, %d", width);
+    println("  jmp .Lvbegin%d", label);
+    println(".Lvend%d:", label);
+    if (avx2) {
+        println("  vzeroupper");
+    }
+
+    // 進めた i を書き戻す
+    if (iv->reg) {
+        extend_to_reg(iv->reg, "rdx", iv->type);
+    }
+    else {
+        println("  mov %s, edx", local_addr(iv));
+    }
+    println("  add rsp, %d", 8 * nslots);
+    depth -= nslots;
+    cfi_adjust_rsp();
+
+    gen_stmt(node->els);
+}
 
 // ノードを左辺値として評価して、スタックにプッシュする
 // 左辺値として評価できない場合はエラーとする
@@ -40,15 +436,13 @@ static void gen_lval(struct ast *node)
 {
     switch (node->kind) {
     case AST_LVAR: {
-        // 変数には RBP - offset でアクセスできる
-        println("  mov rax, rbp");
-        println("  sub rax, %d", node->var->offset);
-        println("  push rax");
+        println("  lea rax, %s", local_addr(node->var));
+        push("rax");
         return;
     }
     case AST_GVAR: {
         println("  mov rax, offset %s", node->var->name);
-        println("  push rax");
+        push("rax");
         return;
     }
     case AST_DEREF: {
@@ -61,75 +455,129 @@ static void gen_lval(struct ast *node)
     error("左辺値として評価できません");
 }
 
+// 文を評価する
+// 式文の場合は評価値を捨てて、文の前後でスタックの深さが変わらないようにする
+static void gen_stmt(struct ast *node)
+{
+    if (debug_info && node->line) {
+        println("  .loc 1 %d", node->line);
+    }
+    switch (node->kind) {
+    case AST_RETURN:
+    case AST_IF:
+    case AST_WHILE:
+    case AST_FOR:
+    case AST_BLOCK:
+    case AST_VARDECL:
+    case AST_VLOOP:
+        gen(node);
+        return;
+    }
+    gen(node);
+    println("  add rsp, 8");
+    depth--;
+    cfi_adjust_rsp();
+}
+
 static void gen(struct ast *node)
 {
     switch (node->kind) {
     case AST_NUM: {
-        println("  push %d", node->val);
+        push(format("%d", node->val));
         return;
     }
     case AST_LVAR:
     case AST_GVAR: {
+        if (node->kind == AST_LVAR && node->var->reg) {
+            push(node->var->reg);
+            return;
+        }
         // 変数を右辺値として評価する
         // スタックトップに変数のアドレスが来る
         gen_lval(node);
-        if (node->var->type->bt != T_ARRAY) {
-            // 配列でない場合は変数の中身を読み出す
-            load(node->var->type);
-        }
+        load(node->var->type);
         return;
     }
     case AST_STRING: {
         println("  mov rax, offset flat:.L.string%d", node->string_index);
-        println("  push rax");
+        push("rax");
         return;
     }
     case AST_ASSIGN: {
+        if (node->lhs->kind == AST_LVAR && node->lhs->var->reg) {
+            gen(node->rhs);
+            pop("rdi");
+            extend_to_reg(node->lhs->var->reg, "rdi", node->lhs->type);
+            push("rdi"); // 代入式の評価値は右辺値
+            return;
+        }
         gen_lval(node->lhs);
         gen(node->rhs);
-        println("  pop rdi"); // 右辺値
-        println("  pop rax"); // 左辺アドレス
-        println("  mov [rax], rdi");
-        println("  push rdi"); // 代入式の評価値は右辺値
+        store(node->lhs->type);
         return;
     }
     case AST_RETURN: {
+        if (node->lhs->kind == AST_FUNCALL && !inline_label && start_label) {
+            gen_tail_call(node->lhs);
+            return;
+        }
         gen(node->lhs); // return 式の値を評価、スタックトップに式の値が残る
-        println("  pop rax");
-        // 呼び出し元の関数フレームに戻る
-        println("  mov rsp, rbp");
-        println("  pop rbp");
-        println("  ret");
+        pop("rax");
+        if (inline_label) {
+            // 展開された関数からの return は展開箇所の出口に飛ぶ
+            println("  jmp .Linline%d", inline_label);
+            return;
+        }
+        gen_epilogue();
         return;
     }
     case AST_IF: {
         int label = get_label();
+        gen_counter(node, PROF_ENTRY);
         gen(node->cond);
-        println("  pop rax");
+        pop("rax");
         println("  cmp rax, 0");
-        if (node->els == NULL) {
+        // プロファイルでめったに通らないと分かった側は関数の末尾に追い出し、よく通る側を分岐せずに実行する
+        int unlikely = unlikely_branch(node);
+        if (unlikely == 1) {
+            println("  jne .Lcold%d", label);
+            if (node->els) {
+                gen_branch(node, false);
+            }
+            println(".Lend%d:", label);
+            gen_cold_branch(node, true, label);
+        }
+        else if (unlikely == 2 && node->els) {
+            println("  je .Lcold%d", label);
+            gen_branch(node, true);
+            println(".Lend%d:", label);
+            gen_cold_branch(node, false, label);
+        }
+        else if (node->els == NULL) {
             println("  je .Lend%d", label);
-            gen(node->then);
+            gen_branch(node, true);
             println(".Lend%d:", label);
         }
         else {
             println("  je .Lelse%d", label);
-            gen(node->then);
+            gen_branch(node, true);
             println("  jmp .Lend%d", label);
             println(".Lelse%d:", label);
-            gen(node->els);
+            gen_branch(node, false);
             println(".Lend%d:", label);
         }
         return;
     }
     case AST_WHILE: {
         int label = get_label();
+        gen_counter(node, PROF_ENTRY);
         println(".Lbegin%d:", label);
         gen(node->cond);
-        println("  pop rax");
+        pop("rax");
         println("  cmp rax, 0");
         println("  je .Lend%d", label);
-        gen(node->stmt);
+        gen_counter(node, PROF_TAKEN);
+        gen_stmt(node->stmt);
         println("  jmp .Lbegin%d", label);
         println(".Lend%d:", label);
         return;
@@ -137,82 +585,179 @@ static void gen(struct ast *node)
     case AST_FOR: {
         int label = get_label();
         if (node->init) {
-            gen(node->init);
+            gen_stmt(node->init);
         }
+        gen_counter(node, PROF_ENTRY);
         println(".Lbegin%d:", label);
         if (node->cond) {
             gen(node->cond);
-            println("  pop rax");
+            pop("rax");
             println("  cmp rax, 0");
             println("  je .Lend%d", label);
         }
-        gen(node->stmt);
+        gen_counter(node, PROF_TAKEN);
+        gen_stmt(node->stmt);
         if (node->update) {
-            gen(node->update);
+            gen_stmt(node->update);
         }
         println("  jmp .Lbegin%d", label);
         println(".Lend%d:", label);
         return;
     }
+    case AST_VLOOP: {
+        gen_vloop(node);
+        return;
+    }
     case AST_BLOCK: {
         for (int i = 0; i < node->stmts->size; i++) {
-            gen(node->stmts->data[i]);
+            gen_stmt(node->stmts->data[i]);
         }
         return;
     }
-    case AST_FUNCALL: {
-        int label = get_label();
-        // 引数をレジスタに載せる
-        for (int i = 0; i < node->params->size; i++) {
-            if (i == 6) {
-                // まだ6個までしか渡せない
-                break;
-            }
-            gen(node->params->data[i]); // スタックトップに引数を評価した値が来る
-            println("  pop rax");
-            println("  mov %s, rax", regs[i]);
+    case AST_INLINE: {
+        // 本体中の return は戻り値を rax に入れて出口に飛んでくる
+        gen_counter(node, PROF_ENTRY);
+        int saved = inline_label;
+        inline_label = get_label();
+        for (int i = 0; i < node->stmts->size; i++) {
+            gen_stmt(node->stmts->data[i]);
         }
+        println(".Linline%d:", inline_label);
+        push("rax");
+        inline_label = saved;
+        return;
+    }
+    case AST_FUNCALL: {
+        gen_counter(node, PROF_ENTRY);
+        gen_args(node);
 
         // 可変長引数の呼び出しに備えてALを0にする
         println("  mov al, 0");
         // call 命令の時点で rsp を 16 バイト境界に揃える
-        println("  mov rax, rsp");
-        println("  and rax, 15");
-        println("  je .Lcall%d", label);
-        println("  sub rsp, 8");
-        println("  call %s", node->funcname);
-        println("  add rsp, 8");
-        println("  jmp .Lend%d", label);
-        println(".Lcall%d:", label);
-        println("  call %s", node->funcname);
-        println(".Lend%d:", label);
-        println("  push rax"); // 関数の戻り値をスタックトップに載せる
+        // 関数入口以降の push の回数から静的に決まる
+        if (depth % 2) {
+            println("  sub rsp, 8");
+            println("  call %s", node->funcname);
+            println("  add rsp, 8");
+        }
+        else {
+            println("  call %s", node->funcname);
+        }
+        push("rax"); // 関数の戻り値をスタックトップに載せる
         return;
     }
     case AST_FUNCTION: {
-        println("%s:", node->funcname);
-        println("  push rbp");
-        println("  mov rbp, rsp");
+        // 変数をレジスタとスタック上の領域に割り当てる
+        allocate_registers(node);
+        layout_frame(node);
+        saved_regs = node->saved_regs;
+        int nsaved = saved_regs->size;
+        current_func = node;
+        cold_blocks = new_vector();
+
+        // ローカル変数のアドレスが外に出うる関数では、フレームを畳んだり再利用したりできない
+        start_label = 0;
+        if (sibling_calls && !takes_local_addr(node)) {
+            start_label = get_label();
+        }
+
+        // 関数呼び出しを含まない葉関数ではフレームポインタを省略する
+        // 式の評価に使うスタックと変数の領域がレッドゾーンに収まる場合は RSP も動かさない
+        use_fp = !omit_frame_pointer || !is_leaf(node);
+        frame_top = 0;
+        sub_size = 0;
+        // 退避したレジスタは関数入口で push したものとして深さに数える
+        if (!use_fp) {
+            silent = true;
+            depth = max_depth = nsaved;
+            for (int i = 0; i < node->stmts->size; i++) {
+                gen_stmt(node->stmts->data[i]);
+            }
+            silent = false;
+            if (8 * max_depth + node->stack_size <= RED_ZONE_SIZE) {
+                frame_top = 8 * max_depth;
+            }
+            else {
+                frame_top = 8 * nsaved;
+                sub_size = node->stack_size;
+            }
+        }
+        depth = max_depth = 0;
+        frame_allocated = false;
 
-        // ローカル変数の領域
-        if (node->locals) {
-            println("  sub rsp, %d", node->locals->offset);
+        println("%s:", node->funcname);
+        println("  .cfi_startproc");
+        if (debug_info && node->line) {
+            println("  .loc 1 %d", node->line);
+        }
+        if (use_fp) {
+            println("  push rbp");
+            println("  .cfi_def_cfa_offset 16");
+            println("  .cfi_offset rbp, -16");
+            println("  mov rbp, rsp");
+            println("  .cfi_def_cfa_register rbp");
+            sub_size = node->stack_size;
+            if (sub_size) {
+                println("  sub rsp, %d", sub_size);
+            }
+        }
+        for (int i = 0; i < nsaved; i++) {
+            push(saved_regs->data[i]);
+            // 退避したレジスタの CFA からの位置
+            println("  .cfi_offset %s, %d", saved_regs->data[i], use_fp ? -16 - sub_size - 8 * (i + 1) : -8 - 8 * (i + 1));
+        }
+        if (!use_fp && sub_size) {
+            println("  sub rsp, %d", sub_size);
+            frame_allocated = true;
+            cfi_adjust_rsp();
         }
 
-        // 引数をスタックにコピーする
+        // 引数を仮引数のレジスタか領域にコピーする
+        // レジスタに置く仮引数は、他の引数レジスタを壊さないよう後でまとめてコピーする
+        if (start_label) {
+            println(".Lstart%d:", start_label);
+        }
+        for (int i = 0; i < node->params->size; i++) {
+            struct var *var = node->params->data[i];
+            if (var->reg) {
+                continue;
+            }
+            switch (var->type->bt) {
+            case T_CHAR:
+                println("  mov %s, %s", local_addr(var), regs8[i]);
+                break;
+            case T_INT:
+                println("  mov %s, %s", local_addr(var), regs32[i]);
+                break;
+            default:
+                println("  mov %s, %s", local_addr(var), regs[i]);
+                break;
+            }
+        }
         for (int i = 0; i < node->params->size; i++) {
-            println("  mov [rbp - %d], %s", 8 * (i + 1), regs[i]);
+            struct var *var = node->params->data[i];
+            if (var->reg) {
+                extend_to_reg(var->reg, regs[i], var->type);
+            }
         }
+        gen_counter(node, PROF_ENTRY);
 
         // 本体のコード生成
         for (int i = 0; i < node->stmts->size; i++) {
-            gen(node->stmts->data[i]);
+            gen_stmt(node->stmts->data[i]);
         }
 
         // 関数のエピローグ
-        println("  mov rsp, rbp");
-        println("  pop rbp");
-        println("  ret");
+        gen_epilogue();
+
+        // めったに実行されないコードは関数の末尾にまとめる
+        for (int i = 0; i < cold_blocks->size; i++) {
+            struct vector *lines = cold_blocks->data[i];
+            for (int j = 0; j < lines->size; j++) {
+                println("%s", lines->data[j]);
+            }
+        }
+        println("  .cfi_endproc");
         return;
     }
     case AST_ADDR: {
@@ -221,9 +766,7 @@ static void gen(struct ast *node)
     }
     case AST_DEREF: {
         gen(node->lhs); // スタックトップにアドレスが入る
-        println("  pop rax");
-        println("  mov rax, [rax]");
-        println("  push rax");
+        load(node->type);
         return;
     }
     case AST_VARDECL: {
@@ -234,8 +777,8 @@ static void gen(struct ast *node)
     gen(node->lhs);
     gen(node->rhs);
 
-    println("  pop rdi");
-    println("  pop rax");
+    pop("rdi");
+    pop("rax");
 
     switch (node->kind) {
     case AST_ADD:
@@ -272,32 +815,210 @@ static void gen(struct ast *node)
         println("  movzb rax, al");
         break;
     case AST_ADD_PTR: {
-        println("  imul rdi, %d", node->lhs->var->type->ptr_to->nbyte);
+        println("  imul rdi, %d", node->type->ptr_to->nbyte);
         println("  add rax, rdi");
         break;
     }
     }
 
-    println("  push rax");
+    push("rax");
 }
 
-void generate(void)
+// 文字列をアセンブラの .string の引数として書ける形にする
+static char *quote_string(char *str)
 {
-    // アセンブリの前半部分
-    println(".intel_syntax noprefix");
-    println(".global main");
+    char *buf = calloc(strlen(str) * 4 + 3, sizeof(char));
+    char *p = buf;
+    *p++ = '"';
+    for (unsigned char *s = (unsigned char *)str; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            p += sprintf(p, "\\%c", *s);
+        }
+        else if (isprint(*s)) {
+            *p++ = *s;
+        }
+        else {
+            p += sprintf(p, "\\%03o", *s);
+        }
+    }
+    *p++ = '"';
+    return buf;
+}
+
+// -fprofile-generate: カウンタの領域と、プログラムの終了時にそれをファイルに書き出す関数
+// カウンタの前には、-fprofile-use で入力との対応を確かめるための値を置く
+static void gen_profile_dump(void)
+{
+    int n = profile_size();
+    println(".data");
+    println(".align 8");
+    println(".Lprof:");
+    println("  .quad %ld", profile_checksum());
+    println("  .quad %d", n);
+    println("  .zero %d", 16 * n);
+    println(".Lprof.path:");
+    println("  .string %s", quote_string(profile_generate));
+    println(".Lprof.mode:");
+    println("  .string \"wb\"");
+
+    // 終了処理 (.fini_array) から呼ばれる
     println(".text");
+    println(".Lprof.dump:");
+    println("  push rbx"); // 呼び出し時の RSP を 16 バイト境界に揃える
+    println("  mov rdi, offset flat:.Lprof.path");
+    println("  mov rsi, offset flat:.Lprof.mode");
+    println("  call fopen");
+    println("  test rax, rax");
+    println("  je .Lprof.end");
+    println("  mov rbx, rax");
+    println("  mov rdi, offset flat:.Lprof");
+    println("  mov rsi, 8");
+    println("  mov rdx, %d", 2 + 2 * n);
+    println("  mov rcx, rbx");
+    println("  call fwrite");
+    println("  mov rdi, rbx");
+    println("  call fclose");
+    println(".Lprof.end:");
+    println("  pop rbx");
+    println("  ret");
+    println(".section .fini_array, \"aw\"");
+    println("  .quad .Lprof.dump");
+}
+
+// 文字列リテラルを、リンカが同じ内容の文字列をまとめられる読み出し専用のセクションに置く
+// 他の文字列の末尾と一致する文字列は、その長い方の文字列の途中を指すラベルにする
+static void gen_string_literals(void)
+{
+    println(".section .rodata.str1.1, \"aMS\", @progbits, 1");
     for (int i = 0; i < string_literals->size; i++) {
+        char *str = string_literals->data[i];
+        if (!str) {
+            continue; // どこからも使われない
+        }
+        int len = strlen(str);
+
+        // str を末尾に持つ最も長い文字列
+        int host = -1;
+        int host_len = len;
+        for (int j = 0; j < string_literals->size; j++) {
+            char *s = string_literals->data[j];
+            if (!s || j == i) {
+                continue;
+            }
+            int n = strlen(s);
+            if (host_len < n && !strcmp(s + n - len, str)) {
+                host = j;
+                host_len = n;
+            }
+        }
+        if (host >= 0) {
+            println(".set .L.string%d, .L.string%d + %d", i, host, host_len - len);
+            continue;
+        }
         println(".L.string%d:", i);
-        println("  .string \"%s\"", string_literals->data[i]);
+        println("  .string %s", quote_string(str));
     }
-    struct vector *all_ast = get_all_ast();
-    for (int i = 0; i < all_ast->size; i++) {
-        gen(all_ast->data[i]);
+}
+
+// 初期値の offset バイト目から end バイト目の手前までを、0 の並びは .zero、それ以外は .byte で出力する
+static void gen_init_bytes(char *data, int offset, int end)
+{
+    while (offset < end) {
+        int n = 0;
+        while (offset + n < end && !data[offset + n]) {
+            n++;
+        }
+        if (n > 0) {
+            println("  .zero %d", n);
+            offset += n;
+            continue;
+        }
+        char line[128] = "  .byte ";
+        int len = strlen(line);
+        for (n = 0; offset < end && data[offset] && n < 16; offset++, n++) {
+            len += sprintf(line + len, "%s%d", n ? ", " : "", (unsigned char)data[offset]);
+        }
+        println("%s", line);
     }
-    println(".data");
+}
+
+static bool has_initializer(struct var *var)
+{
+    return var->init_data || (var->relocs && var->relocs->size);
+}
+
+// 初期値を持つグローバル変数は .data に、すべて 0 のものは .bss に置く
+static void gen_global_vars(void)
+{
+    println(".bss");
     for (struct var *var = get_global_vars(); var != NULL; var = var->next) {
+        if (has_initializer(var)) {
+            continue;
+        }
+        println(".align %d", var->type->align);
         println("%s:", var->name);
         println("  .zero %d", var->type->nbyte);
     }
+
+    println(".data");
+    for (struct var *var = get_global_vars(); var != NULL; var = var->next) {
+        if (!has_initializer(var)) {
+            continue;
+        }
+        println(".align %d", var->type->align);
+        println("%s:", var->name);
+        // reloc は初期値の先頭からの位置の順に並んでいる
+        int offset = 0;
+        for (int i = 0; var->relocs && i < var->relocs->size; i++) {
+            struct reloc *r = var->relocs->data[i];
+            gen_init_bytes(var->init_data, offset, r->offset);
+            if (r->var) {
+                println("  .quad %s%+ld", r->var->name, r->addend);
+            }
+            else {
+                println("  .quad .L.string%d%+ld", r->string_index, r->addend);
+            }
+            offset = r->offset + 8;
+        }
+        gen_init_bytes(var->init_data, offset, var->type->nbyte);
+    }
+}
+
+// アセンブリの先頭部分
+void gen_header(void)
+{
+    println(".intel_syntax noprefix");
+    if (debug_info) {
+        println(".file 1 \"%s\"", filename);
+    }
+    println(".global main");
+    for (int i = 0; i < exported_symbols->size; i++) {
+        println(".global %s", exported_symbols->data[i]);
+    }
+}
+
+void gen_function(struct ast *func)
+{
+    println(".text");
+    gen(func);
+}
+
+// 関数の後に、関数から参照されるデータを置く
+void gen_data(void)
+{
+    gen_string_literals();
+    gen_global_vars();
+    if (profile_generate) {
+        gen_profile_dump();
+    }
+}
+
+void generate(void)
+{
+    gen_header();
+    struct vector *all_ast = get_all_ast();
+    for (int i = 0; i < all_ast->size; i++) {
+        gen_function(all_ast->data[i]);
+    }
+    gen_data();
 }
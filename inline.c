@@ -0,0 +1,184 @@
+#include "rehabcc.h"
+
+// 関数定義と、その関数が直接呼び出す関数
+struct func_info {
+    struct ast *func;
+    struct vector *callees; // struct func_info *
+    bool recursive;         // 自分自身を (間接的に) 呼び出しうる
+    bool visited;
+};
+
+static struct func_info *infos;
+static int ninfos;
+
+static struct func_info *find_info(char *name)
+{
+    for (int i = 0; i < ninfos; i++) {
+        if (!strcmp(infos[i].func->funcname, name)) {
+            return &infos[i];
+        }
+    }
+    return NULL;
+}
+
+static void collect_callees(struct ast **ast, void *arg)
+{
+    struct func_info *info = arg;
+    if ((*ast)->kind == AST_FUNCALL) {
+        struct func_info *callee = find_info((*ast)->funcname);
+        bool found = false;
+        for (int i = 0; callee && i < info->callees->size; i++) {
+            found |= info->callees->data[i] == callee;
+        }
+        if (callee && !found) {
+            vector_push_back(info->callees, callee);
+        }
+    }
+    walk_ast_children(*ast, collect_callees, arg);
+}
+
+static bool reaches(struct func_info *from, struct func_info *to, bool *seen)
+{
+    for (int i = 0; i < from->callees->size; i++) {
+        struct func_info *callee = from->callees->data[i];
+        if (callee == to) {
+            return true;
+        }
+        if (!seen[callee - infos]) {
+            seen[callee - infos] = true;
+            if (reaches(callee, to, seen)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// 呼び出される側の関数が先に来る順序 (帰りがけ順) で並べる
+static void postorder(struct func_info *info, struct vector *order)
+{
+    if (info->visited) {
+        return;
+    }
+    info->visited = true;
+    for (int i = 0; i < info->callees->size; i++) {
+        postorder(info->callees->data[i], order);
+    }
+    vector_push_back(order, info);
+}
+
+// 呼び出し元の関数のスコープの下に、展開する関数のスコープ木を複製する
+// 複製した変数は呼び出し元のローカル変数になり、元の変数との対応を from, to に記録する
+static struct scope *copy_scope(struct scope *scope, struct scope *parent, struct ast *caller, struct vector *from, struct vector *to)
+{
+    struct scope *copy = new_scope(parent);
+    vector_push_back(from, scope);
+    vector_push_back(to, copy);
+    for (int i = 0; i < scope->vars->size; i++) {
+        struct var *var = arena_alloc(sizeof(struct var));
+        *var = *(struct var *)scope->vars->data[i];
+        var->next = caller->locals;
+        caller->locals = var;
+        vector_push_back(copy->vars, var);
+        vector_push_back(from, scope->vars->data[i]);
+        vector_push_back(to, var);
+    }
+    for (int i = 0; i < scope->children->size; i++) {
+        copy_scope(scope->children->data[i], copy, caller, from, to);
+    }
+    return copy;
+}
+
+// 関数呼び出し call を、callee の本体を複製した AST_INLINE に置き換える
+// 実引数は複製した仮引数への代入になる
+static struct ast *expand(struct ast *caller, struct scope *scope, struct ast *callee, struct ast *call)
+{
+    struct vector *from = new_vector();
+    struct vector *to = new_vector();
+
+    struct ast *ast = new_ast(AST_INLINE, callee->type);
+    ast->funcname = callee->funcname;
+    ast->prof_id = call->prof_id;
+    ast->scope = copy_scope(callee->scope, scope, caller, from, to);
+    ast->stmts = new_vector();
+    for (int i = 0; i < call->params->size; i++) {
+        struct var *param = callee->params->data[i];
+        struct ast *lhs = new_ast(AST_LVAR, param->type);
+        lhs->var = param;
+        lhs = copy_ast(lhs, from, to); // 複製した仮引数を指すようにする
+        struct ast *arg = call->params->data[i];
+        vector_push_back(ast->stmts, new_ast_binary(AST_ASSIGN, arg->type, lhs, arg));
+    }
+    for (int i = 0; i < callee->stmts->size; i++) {
+        vector_push_back(ast->stmts, copy_ast(callee->stmts->data[i], from, to));
+    }
+    return ast;
+}
+
+struct inline_ctx {
+    struct func_info *caller;
+    struct scope *scope; // 呼び出し箇所を囲む最も内側のスコープ
+};
+
+// プロファイルがあれば、実行されなかった呼び出しは展開せず、よく実行される呼び出しは大きな関数も展開する
+static bool can_inline(struct inline_ctx *ctx, struct func_info *callee, struct ast *call)
+{
+    int limit = is_hot_call(call) ? 2 * inline_limit : inline_limit;
+    return callee && callee != ctx->caller && !callee->recursive && callee->func->params->size == call->params->size &&
+           !is_cold(call) && count_ast(callee->func) <= limit;
+}
+
+static void inline_child(struct ast **ast, void *arg)
+{
+    struct inline_ctx *ctx = arg;
+    struct ast *node = *ast;
+
+    if (node->kind == AST_BLOCK || node->kind == AST_INLINE) {
+        struct scope *saved = ctx->scope;
+        ctx->scope = node->scope;
+        walk_ast_children(node, inline_child, ctx);
+        ctx->scope = saved;
+        return;
+    }
+
+    // 実引数の中の呼び出しを先に展開する
+    walk_ast_children(node, inline_child, ctx);
+    if (node->kind == AST_FUNCALL) {
+        struct func_info *callee = find_info(node->funcname);
+        if (can_inline(ctx, callee, node)) {
+            *ast = expand(ctx->caller->func, ctx->scope, callee->func, node);
+        }
+    }
+}
+
+// 再帰しない小さな関数の呼び出しを、関数本体で置き換える
+// 呼び出される側から先に処理するので、展開した本体の中の呼び出しも展開済みになる
+void inline_calls(void)
+{
+    struct vector *funcs = get_all_ast();
+    infos = calloc(funcs->size, sizeof(struct func_info));
+    ninfos = funcs->size;
+    for (int i = 0; i < ninfos; i++) {
+        infos[i].func = funcs->data[i];
+        infos[i].callees = new_vector();
+    }
+
+    // 呼び出しグラフを作る
+    for (int i = 0; i < ninfos; i++) {
+        walk_ast_children(infos[i].func, collect_callees, &infos[i]);
+    }
+    for (int i = 0; i < ninfos; i++) {
+        bool *seen = calloc(ninfos, sizeof(bool));
+        infos[i].recursive = reaches(&infos[i], &infos[i], seen);
+    }
+
+    struct vector *order = new_vector();
+    for (int i = 0; i < ninfos; i++) {
+        postorder(&infos[i], order);
+    }
+    for (int i = 0; i < order->size; i++) {
+        struct inline_ctx ctx = {order->data[i], NULL};
+        ctx.scope = ctx.caller->func->scope;
+        walk_ast_children(ctx.caller->func, inline_child, &ctx);
+    }
+}
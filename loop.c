@@ -0,0 +1,547 @@
+#include "rehabcc.h"
+
+// 関数全体で共有する情報
+struct loop_ctx {
+    struct ast *func;
+    struct scope *scope;       // 着目している箇所を囲む最も内側のスコープ
+    struct vector *addr_taken; // アドレスを取られうるローカル変数
+
+    // 各ループに適用する変換
+    struct ast *(*transform)(struct loop_ctx *, struct ast *);
+};
+
+// ループの中で値が変わりうるもの
+struct loop_info {
+    struct vector *assigned; // ループ内で代入される変数
+    bool writes_memory;      // ポインタ経由の書き込みか関数呼び出しを含む
+};
+
+static void collect_writes(struct ast **ast, void *arg)
+{
+    struct loop_info *info = arg;
+    struct ast *node = *ast;
+    if (node->kind == AST_ASSIGN) {
+        if (node->lhs->kind == AST_LVAR || node->lhs->kind == AST_GVAR) {
+            vector_push_back(info->assigned, node->lhs->var);
+        }
+        else {
+            info->writes_memory = true;
+        }
+    }
+    if (node->kind == AST_FUNCALL) {
+        info->writes_memory = true;
+    }
+    walk_ast_children(node, collect_writes, arg);
+}
+
+static struct loop_info *analyze(struct ast *loop, bool with_update)
+{
+    struct loop_info *info = arena_alloc(sizeof(struct loop_info));
+    info->assigned = new_vector();
+    if (loop->cond) {
+        collect_writes(&loop->cond, info);
+    }
+    collect_writes(&loop->stmt, info);
+    if (with_update && loop->update) {
+        collect_writes(&loop->update, info);
+    }
+    return info;
+}
+
+// 式の値がループの実行中に変わらないかどうか
+// ループに入らない場合にも評価されてよいよう、割り算やメモリの読み出しなど失敗しうる式は含めない
+static bool is_invariant(struct loop_ctx *ctx, struct loop_info *info, struct ast *ast)
+{
+    switch (ast->kind) {
+    case AST_NUM:
+    case AST_STRING:
+        return true;
+    case AST_LVAR:
+    case AST_GVAR: {
+        if (ast->var->type->bt == T_ARRAY) {
+            return true; // 配列の値は先頭アドレス
+        }
+        bool escaped = ast->kind == AST_GVAR || vector_contains(ctx->addr_taken, ast->var);
+        return !vector_contains(info->assigned, ast->var) && !(escaped && info->writes_memory);
+    }
+    case AST_ADDR:
+        return ast->lhs->kind == AST_LVAR || ast->lhs->kind == AST_GVAR;
+    case AST_ADD:
+    case AST_SUB:
+    case AST_MUL:
+    case AST_EQ:
+    case AST_NE:
+    case AST_LT:
+    case AST_LE:
+    case AST_ADD_PTR:
+        return is_invariant(ctx, info, ast->lhs) && is_invariant(ctx, info, ast->rhs);
+    }
+    return false;
+}
+
+// 演算を含み、ループの外に出す価値がある式かどうか
+static bool is_computation(struct ast *ast)
+{
+    switch (ast->kind) {
+    case AST_ADD:
+    case AST_SUB:
+    case AST_MUL:
+    case AST_EQ:
+    case AST_NE:
+    case AST_LT:
+    case AST_LE:
+    case AST_ADD_PTR:
+        return true;
+    }
+    return false;
+}
+
+// ast の値を保持する一時変数を作り、プリヘッダ (ループの直前) での代入を pre に積む
+// 計算途中の値を切り詰めないよう、一時変数は 64 bit で保持するためポインタ型にする
+static struct ast *new_temp(struct loop_ctx *ctx, struct vector *pre, struct ast *ast)
+{
+    struct var *var = add_temp_var(ctx->func, ctx->scope, ptr_type(ast->type ? ast->type : int_type()));
+    struct ast *lhs = new_ast(AST_LVAR, var->type);
+    lhs->var = var;
+    vector_push_back(pre, new_ast_binary(AST_ASSIGN, var->type, lhs, ast));
+
+    struct ast *use = new_ast(AST_LVAR, ast->type);
+    use->var = var;
+    return use;
+}
+
+struct hoist {
+    struct loop_ctx *ctx;
+    struct loop_info *info;
+    struct vector *pre;
+};
+
+static void hoist_invariants(struct ast **ast, void *arg)
+{
+    struct hoist *h = arg;
+    if (is_computation(*ast) && is_invariant(h->ctx, h->info, *ast)) {
+        *ast = new_temp(h->ctx, h->pre, *ast);
+        return;
+    }
+    walk_ast_children(*ast, hoist_invariants, arg);
+}
+
+// 誘導変数 i について ast が m * i + k の形の式なら m, k を求める
+static bool affine(struct ast *ast, struct var *i, int *m, int *k)
+{
+    int m1, k1, m2, k2;
+    switch (ast->kind) {
+    case AST_NUM:
+        *m = 0;
+        *k = ast->val;
+        return true;
+    case AST_LVAR:
+        if (ast->var != i) {
+            return false;
+        }
+        *m = 1;
+        *k = 0;
+        return true;
+    case AST_ADD:
+    case AST_SUB:
+        if (!affine(ast->lhs, i, &m1, &k1) || !affine(ast->rhs, i, &m2, &k2)) {
+            return false;
+        }
+        *m = ast->kind == AST_ADD ? m1 + m2 : m1 - m2;
+        *k = ast->kind == AST_ADD ? k1 + k2 : k1 - k2;
+        return true;
+    case AST_MUL:
+        if (!affine(ast->lhs, i, &m1, &k1) || !affine(ast->rhs, i, &m2, &k2) || (m1 && m2)) {
+            return false;
+        }
+        *m = m1 * k2 + m2 * k1;
+        *k = k1 * k2;
+        return true;
+    }
+    return false;
+}
+
+// for 文の update が i = i + c か i = i - c なら i を返し、c を step に入れる
+static struct var *find_induction_var(struct ast *loop, int *step)
+{
+    struct ast *update = loop->update;
+    if (!update || update->kind != AST_ASSIGN || update->lhs->kind != AST_LVAR || update->lhs->var->type->bt != T_INT) {
+        return NULL;
+    }
+    struct var *i = update->lhs->var;
+    int m, k;
+    if (!affine(update->rhs, i, &m, &k) || m != 1) {
+        return NULL;
+    }
+    *step = k;
+    return i;
+}
+
+// ループ内の base[m * i + k] を、プリヘッダで初期化して i と一緒に進めるポインタに置き換える
+struct reduce {
+    struct loop_ctx *ctx;
+    struct loop_info *info;
+    struct var *iv;
+    int step;
+    struct vector *pre;     // プリヘッダでの初期化
+    struct vector *bases;   // 置き換えた ADD_PTR
+    struct vector *ptrs;    // 対応するポインタ変数の参照
+    struct vector *strides; // 1 反復で進める要素数 (int を void * に入れる)
+};
+
+static void reduce_strength(struct ast **ast, void *arg)
+{
+    struct reduce *r = arg;
+    struct ast *node = *ast;
+    int m, k;
+    if (node->kind == AST_ADD_PTR && is_invariant(r->ctx, r->info, node->lhs) && affine(node->rhs, r->iv, &m, &k) && m) {
+        for (int i = 0; i < r->bases->size; i++) {
+            if (same_ast(r->bases->data[i], node)) {
+                *ast = copy_ast(r->ptrs->data[i], NULL, NULL);
+                return;
+            }
+        }
+        struct ast *ptr = new_temp(r->ctx, r->pre, node);
+        vector_push_back(r->bases, node);
+        vector_push_back(r->ptrs, ptr);
+        vector_push_back(r->strides, (void *)(long)(m * r->step));
+        *ast = copy_ast(ptr, NULL, NULL);
+        return;
+    }
+    walk_ast_children(node, reduce_strength, arg);
+}
+
+// ループを書き換えて作るブロック
+// 元のループ本体のスコープは ctx->scope の子のままなので、新しいスコープは作らず ctx->scope を共有する。
+// 間にスコープを挟むと、そこに置いた一時変数と本体の変数が兄弟スコープとして同じ領域を使ってしまう
+static struct ast *new_block(struct loop_ctx *ctx)
+{
+    struct ast *block = new_ast(AST_BLOCK, NULL);
+    block->scope = ctx->scope;
+    block->stmts = new_vector();
+    return block;
+}
+
+// for (init; cond; update) stmt を
+//   { init; プリヘッダ; for (; cond;) { stmt; update; ポインタの更新; } }
+// に書き換える。continue 文はないので update を本体の末尾に移しても意味は変わらない
+static struct ast *optimize_loop(struct loop_ctx *ctx, struct ast *loop)
+{
+    struct ast *block = new_block(ctx);
+
+    struct ast *init = loop->kind == AST_FOR ? loop->init : NULL;
+    loop->init = NULL;
+    if (init) {
+        vector_push_back(block->stmts, init);
+    }
+    struct vector *pre = new_vector();
+
+    // 誘導変数の強度低減
+    int step;
+    struct var *iv = loop->kind == AST_FOR ? find_induction_var(loop, &step) : NULL;
+    if (ivopts && iv && !vector_contains(ctx->addr_taken, iv)) {
+        struct loop_info *info = analyze(loop, false);
+        if (!vector_contains(info->assigned, iv)) {
+            struct reduce r = {ctx, info, iv, step, pre, new_vector(), new_vector(), new_vector()};
+            if (loop->cond) {
+                reduce_strength(&loop->cond, &r);
+            }
+            reduce_strength(&loop->stmt, &r);
+            if (r.ptrs->size) {
+                struct ast *body = new_block(ctx);
+                vector_push_back(body->stmts, loop->stmt);
+                vector_push_back(body->stmts, loop->update);
+                for (int i = 0; i < r.ptrs->size; i++) {
+                    struct ast *ptr = r.ptrs->data[i];
+                    struct ast *lhs = new_ast(AST_LVAR, ptr->var->type);
+                    lhs->var = ptr->var;
+                    struct ast *next = new_ast_binary(AST_ADD_PTR, ptr->type, ptr, new_ast_num((long)r.strides->data[i]));
+                    vector_push_back(body->stmts, new_ast_binary(AST_ASSIGN, ptr->type, lhs, next));
+                }
+                loop->stmt = body;
+                loop->update = NULL;
+            }
+        }
+    }
+
+    // ループ不変式の移動
+    if (loop_invariants) {
+        struct hoist h = {ctx, analyze(loop, true), pre};
+        if (loop->cond) {
+            hoist_invariants(&loop->cond, &h);
+        }
+        hoist_invariants(&loop->stmt, &h);
+        if (loop->update) {
+            hoist_invariants(&loop->update, &h);
+        }
+    }
+
+    if (pre->size == 0) {
+        // 何も移動しなかった
+        loop->init = init;
+        return loop;
+    }
+    for (int i = 0; i < pre->size; i++) {
+        vector_push_back(block->stmts, pre->data[i]);
+    }
+    vector_push_back(block->stmts, loop);
+    return block;
+}
+
+// 誘導変数 i の読み出しを expr で置き換える
+struct subst {
+    struct var *var;
+    struct ast *expr;
+};
+
+static void substitute(struct ast **ast, void *arg)
+{
+    struct subst *sub = arg;
+    if ((*ast)->kind == AST_LVAR && (*ast)->var == sub->var) {
+        *ast = copy_ast(sub->expr, NULL, NULL);
+        return;
+    }
+    walk_ast_children(*ast, substitute, arg);
+}
+
+// 本体を複製し、その中の i を i + offset に置き換える
+static struct ast *copy_body(struct ast *body, struct var *iv, int offset)
+{
+    struct ast *ref = new_ast(AST_LVAR, iv->type);
+    ref->var = iv;
+    struct subst sub = {iv, offset ? new_ast_binary(AST_ADD, int_type(), ref, new_ast_num(offset)) : ref};
+    struct ast *copy = copy_ast(body, NULL, NULL);
+    substitute(&copy, &sub);
+    return copy;
+}
+
+// 条件式 cond が i < lim, i <= lim (増加するループ) か lim < i, lim <= i (減少するループ) の形なら、
+// i を指す側のオペランドへのポインタを返す
+static struct ast **find_bound(struct loop_ctx *ctx, struct ast *loop, struct var *iv, int step)
+{
+    struct ast *cond = loop->cond;
+    if (!cond || (cond->kind != AST_LT && cond->kind != AST_LE)) {
+        return NULL;
+    }
+    struct loop_info *info = analyze(loop, false);
+    if (step > 0 && cond->lhs->kind == AST_LVAR && cond->lhs->var == iv && is_invariant(ctx, info, cond->rhs)) {
+        return &cond->lhs;
+    }
+    if (step < 0 && cond->rhs->kind == AST_LVAR && cond->rhs->var == iv && is_invariant(ctx, info, cond->lhs)) {
+        return &cond->rhs;
+    }
+    return NULL;
+}
+
+static bool compare(int kind, int lhs, int rhs)
+{
+    return kind == AST_LT ? lhs < rhs : lhs <= rhs;
+}
+
+// 反復回数が定数で決まる場合はその回数を返す。max 回を超える場合や決まらない場合は -1
+static int trip_count(struct ast *loop, struct var *iv, int step, int max)
+{
+    struct ast *init = loop->init;
+    struct ast *cond = loop->cond;
+    if (!init || init->kind != AST_ASSIGN || init->lhs->kind != AST_LVAR || init->lhs->var != iv || init->rhs->kind != AST_NUM) {
+        return -1;
+    }
+    struct ast *bound = cond->lhs->kind == AST_LVAR ? cond->rhs : cond->lhs;
+    if (bound->kind != AST_NUM) {
+        return -1;
+    }
+    long v = init->rhs->val;
+    for (int n = 0; n <= max; n++) {
+        bool taken = cond->lhs == bound ? compare(cond->kind, bound->val, v) : compare(cond->kind, v, bound->val);
+        if (!taken) {
+            return n;
+        }
+        v += step;
+    }
+    return -1;
+}
+
+// for (i = c0; i < lim; i = i + c) stmt を展開する
+// 反復回数が定数で小さい場合は、i を定数に置き換えた本体を並べて完全に展開する。
+// それ以外は unroll_factor 回分の本体を並べたループと、端数を処理する元のループに分ける
+//   for (init; i + (N-1)*c < lim; i = i + N*c) { stmt[i]; stmt[i+c]; ... }
+//   for (; i < lim; i = i + c) stmt
+static struct ast *unroll_loop(struct loop_ctx *ctx, struct ast *loop)
+{
+    int step;
+    struct var *iv = loop->kind == AST_FOR ? find_induction_var(loop, &step) : NULL;
+    if (!iv || !step || vector_contains(ctx->addr_taken, iv) || vector_contains(analyze(loop, false)->assigned, iv)) {
+        return loop;
+    }
+    struct ast **bound = find_bound(ctx, loop, iv, step);
+    // 実行されないループは展開しても大きくなるだけ
+    if (!bound || is_cold(loop)) {
+        return loop;
+    }
+
+    int size = count_ast(loop->stmt);
+    int trips = trip_count(loop, iv, step, unroll_limit / size);
+    if (trips >= 0) {
+        struct ast *block = new_block(ctx);
+        vector_push_back(block->stmts, loop->init);
+        long v = loop->init->rhs->val;
+        for (int n = 0; n < trips; n++, v += step) {
+            struct ast *num = new_ast_num(v);
+            struct subst sub = {iv, num};
+            struct ast *copy = copy_ast(loop->stmt, NULL, NULL);
+            substitute(&copy, &sub);
+            vector_push_back(block->stmts, copy);
+        }
+        // ループを抜けた後の i の値
+        struct ast *lhs = copy_ast(loop->update->lhs, NULL, NULL);
+        vector_push_back(block->stmts, new_ast_binary(AST_ASSIGN, iv->type, lhs, new_ast_num(v)));
+        return block;
+    }
+
+    int factor = unroll_factor;
+    if (factor < 2 || size * factor > unroll_limit) {
+        return loop;
+    }
+    // 1 回あたりの反復回数が展開数に満たないループでは、展開した本体をほとんど通らない
+    long entries = profile_count(loop, PROF_ENTRY);
+    if (entries > 0 && profile_count(loop, PROF_TAKEN) < entries * factor) {
+        return loop;
+    }
+
+    struct ast *block = new_block(ctx);
+    if (loop->init) {
+        vector_push_back(block->stmts, loop->init);
+    }
+
+    struct ast *main = new_ast(AST_FOR, NULL);
+    main->cond = copy_ast(loop->cond, NULL, NULL);
+    struct ast **main_bound = *bound == loop->cond->lhs ? &main->cond->lhs : &main->cond->rhs;
+    *main_bound = new_ast_binary(AST_ADD, int_type(), *main_bound, new_ast_num((factor - 1) * step));
+    main->update = copy_ast(loop->update, NULL, NULL);
+    main->update->rhs = new_ast_binary(AST_ADD, int_type(), copy_ast(main->update->lhs, NULL, NULL), new_ast_num(factor * step));
+    main->stmt = new_block(ctx);
+    for (int k = 0; k < factor; k++) {
+        vector_push_back(main->stmt->stmts, copy_body(loop->stmt, iv, k * step));
+    }
+    vector_push_back(block->stmts, main);
+
+    loop->init = NULL;
+    vector_push_back(block->stmts, loop);
+    return block;
+}
+
+// e が base[i] (base はループ不変) の形かどうか
+static bool is_element(struct loop_ctx *ctx, struct loop_info *info, struct ast *e, struct var *iv)
+{
+    if (e->kind != AST_DEREF || e->lhs->kind != AST_ADD_PTR) {
+        return false;
+    }
+    struct ast *index = e->lhs->rhs;
+    return index->kind == AST_LVAR && index->var == iv && is_invariant(ctx, info, e->lhs->lhs);
+}
+
+// ベクトル化した演算の被演算子になれるか
+// 配列の要素 base[i] か、全要素に共通のループ不変な整数
+static bool is_vector_operand(struct loop_ctx *ctx, struct loop_info *info, struct ast *e, struct var *iv, struct type *elem)
+{
+    if (is_element(ctx, info, e, iv)) {
+        return e->type->bt == elem->bt;
+    }
+    return (e->type->bt == T_INT || e->type->bt == T_CHAR) && is_invariant(ctx, info, e);
+}
+
+// for (init; i < n; i = i + 1) a[i] = x op y; をベクトル化する
+// op は + か -、x と y は配列の要素 b[i] かループ不変な整数で、要素は int か char
+// 配列同士が重なっているとまとめて読み書きした結果が変わるので、その判定は実行時に行う
+static struct ast *vectorize_loop(struct loop_ctx *ctx, struct ast *loop)
+{
+    int step;
+    struct var *iv = loop->kind == AST_FOR ? find_induction_var(loop, &step) : NULL;
+    if (!iv || step != 1 || vector_contains(ctx->addr_taken, iv) || !find_bound(ctx, loop, iv, step)) {
+        return loop;
+    }
+
+    struct ast *stmt = loop->stmt;
+    if (stmt->kind == AST_BLOCK && stmt->stmts->size == 1) {
+        stmt = stmt->stmts->data[0];
+    }
+    struct loop_info *info = analyze(loop, true);
+    if (stmt->kind != AST_ASSIGN || !is_element(ctx, info, stmt->lhs, iv)) {
+        return loop;
+    }
+    struct type *elem = stmt->lhs->type;
+    if (elem->bt != T_INT && elem->bt != T_CHAR) {
+        return loop;
+    }
+    struct ast *rhs = stmt->rhs;
+    if (rhs->kind == AST_ADD || rhs->kind == AST_SUB) {
+        if (!is_vector_operand(ctx, info, rhs->lhs, iv, elem) || !is_vector_operand(ctx, info, rhs->rhs, iv, elem)) {
+            return loop;
+        }
+    }
+    else if (!is_vector_operand(ctx, info, rhs, iv, elem)) {
+        return loop;
+    }
+
+    struct ast *vloop = new_ast(AST_VLOOP, NULL);
+    vloop->init = loop->init;
+    vloop->cond = copy_ast(loop->cond, NULL, NULL);
+    vloop->stmt = copy_ast(stmt, NULL, NULL);
+    vloop->update = copy_ast(loop->update, NULL, NULL);
+    vloop->els = loop;
+    loop->init = NULL;
+    return vloop;
+}
+
+// 内側のループから順に変換する
+static void visit(struct ast **ast, void *arg)
+{
+    struct loop_ctx *ctx = arg;
+    struct ast *node = *ast;
+
+    if (node->kind == AST_BLOCK || node->kind == AST_INLINE) {
+        struct scope *saved = ctx->scope;
+        ctx->scope = node->scope;
+        walk_ast_children(node, visit, ctx);
+        ctx->scope = saved;
+        return;
+    }
+
+    if (node->kind == AST_VLOOP && ctx->transform == unroll_loop) {
+        // ベクトル化したループの端数処理は反復回数が少ないので展開しない
+        return;
+    }
+
+    walk_ast_children(node, visit, ctx);
+    if (node->kind == AST_FOR || node->kind == AST_WHILE) {
+        *ast = ctx->transform(ctx, node);
+    }
+}
+
+static void transform_loops(struct ast *(*transform)(struct loop_ctx *, struct ast *))
+{
+    struct vector *funcs = get_all_ast();
+    for (int i = 0; i < funcs->size; i++) {
+        struct loop_ctx ctx = {funcs->data[i], NULL, addr_taken_vars(funcs->data[i]), transform};
+        ctx.scope = ctx.func->scope;
+        walk_ast_children(ctx.func, visit, &ctx);
+    }
+}
+
+// ループのベクトル化
+void vectorize_loops(void)
+{
+    transform_loops(vectorize_loop);
+}
+
+// ループの展開
+void unroll_loops(void)
+{
+    transform_loops(unroll_loop);
+}
+
+// ループ不変式の移動と誘導変数の強度低減
+void optimize_loops(void)
+{
+    transform_loops(optimize_loop);
+}
@@ -0,0 +1,48 @@
+#include "rehabcc.h"
+
+// 定数の伝播と、それで不要になった代入の削除
+static void simplify(void)
+{
+    if (ccp) {
+        propagate_constants();
+    }
+    if (dse) {
+        eliminate_dead_stores();
+    }
+}
+
+// 構文木に対する最適化を順に適用する
+void optimize(void)
+{
+    // 使われない関数は最適化する前に取り除いておく
+    if (whole_program) {
+        remove_unused_symbols();
+    }
+    if (inline_functions) {
+        inline_calls();
+    }
+    simplify();
+    if (eval_pure_calls) {
+        evaluate_pure_calls();
+        // 呼び出しの結果が定数になると、分岐や他の呼び出しの引数も定数になりうる
+        simplify();
+    }
+    if (vectorize) {
+        vectorize_loops();
+    }
+    if (unroll) {
+        unroll_loops();
+        // 完全に展開したループでは誘導変数が定数になっている
+        simplify();
+    }
+    if (loop_invariants || ivopts) {
+        optimize_loops();
+    }
+    if (cse) {
+        eliminate_common_subexprs();
+    }
+    // 展開し尽くされた関数や、取り除いた分岐からしか呼ばれない関数も取り除く
+    if (whole_program) {
+        remove_unused_symbols();
+    }
+}
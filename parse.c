@@ -3,7 +3,10 @@
 // 文法
 // program    = (function | global_var)*
 // function   = type ident "(" paramlist? ")" block
-// global_var = type ident ("[" num "]")? ";"
+// global_var = type ident ("[" num? "]")? ("=" initializer)? ";"
+// initializer = string                                   ... char の配列の場合
+//             | "{" (initializer ("," initializer)* ","?)? "}"
+//             | expr                                     ... コンパイル時に値が決まる式
 // block      = "{" stmt* "}"
 // stmt       = expr ";"
 //            | block
@@ -12,12 +15,12 @@
 //            | "for" "(" expr? ";" expr? ";" expr? ")" stmt
 //            | "return" expr ";"
 //            | type ident ("[" num "]")*;
-// expr       = assign
-// assign     = equality ("=" assign)?
-// equality   = relational ("==" relational | "!=" relational)*
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-// add        = mul ("+" mul | "-" mul)*
-// mul        = primary ("*" primary | "/" primary)*
+// expr       = unary (binop unary)*     ... binary_ops の優先順位と結合規則に従って組み立てる
+// binop      = "=" (右結合)                  ... 弱い
+//            | "==" | "!="
+//            | "<" | "<=" | ">" | ">="
+//            | "+" | "-"
+//            | "*" | "/"                     ... 強い
 // unary      = "+"? primary
 //            | "-"? primary
 //            | "*" unary
@@ -37,15 +40,15 @@ static void parse_program(void);
 static struct ast *parse_function(void);
 static void parse_global_var(void);
 static struct ast *parse_stmt(void);
+static struct ast *parse_stmt_node(void);
 static struct ast *parse_expr(void);
-static struct ast *parse_assign(void);
-static struct ast *parse_equality(void);
-static struct ast *parse_relational(void);
-static struct ast *parse_add(void);
-static struct ast *parse_mul(void);
+static struct ast *parse_binary(int);
 static struct ast *parse_unary(void);
 static struct ast *parse_primary(void);
 
+static struct ast *new_ast_add_ptr(struct ast *, struct ast *);
+static int intern_string(char *);
+static struct ast *new_ast_deref(struct ast *);
 static struct vector *parse_arglist(void);
 static struct type *parse_type(void);
 static struct type *parse_type_postfix(struct type *);
@@ -57,9 +60,17 @@ void parse(void)
 
 static void parse_program(void)
 {
-    int i = 0;
+    struct ast *func;
+    while ((func = parse_next_function())) {
+        add_ast(func);
+    }
+}
+
+// 次の関数定義を読んで返す。その前にあるグローバル変数の宣言も読む。入力の終わりなら NULL
+struct ast *parse_next_function(void)
+{
     while (!consume_token(TK_EOF)) {
-        struct token *backup = get_token();
+        int backup = get_token();
         struct type *type = parse_type();
         if (!type) {
             error_token("関数の返り値の型あるいはグローバル変数の型が与えられていません");
@@ -67,19 +78,18 @@ static void parse_program(void)
         expect_token(TK_IDENT);
         if (consume_token(TK_LPAREN)) {
             set_token(backup);
-            add_ast(parse_function());
-        }
-        else {
-            set_token(backup);
-            parse_global_var();
+            return parse_function();
         }
+        set_token(backup);
+        parse_global_var();
     }
+    return NULL;
 }
 
 static struct ast *parse_function(void)
 {
     struct ast *ast;
-    struct token *tok;
+    int tok;
     struct type *type;
 
     // return type
@@ -92,6 +102,7 @@ static struct ast *parse_function(void)
     // function name
     tok = consume_token(TK_IDENT);
     ast->funcname = copy_token_str(tok);
+    ast->line = token_line(tok);
 
     // parameter
     ast->params = new_vector();
@@ -106,11 +117,11 @@ static struct ast *parse_function(void)
         if (!tok) {
             error_token("不正な引数の名前です");
         }
-        vector_push_back(ast->params, copy_token_str(tok));
-        struct var *lvar = find_local_var(tok);
-        if (!lvar) {
-            add_local_var(tok, type);
+        struct var *lvar = find_scope_var(tok);
+        if (lvar) {
+            error_token("仮引数を重複して宣言しています");
         }
+        vector_push_back(ast->params, add_local_var(tok, type));
         if (!consume_token(TK_COLON)) {
             expect_token(TK_RPAREN);
             break;
@@ -125,23 +136,237 @@ static struct ast *parse_function(void)
     }
 
     ast->locals = get_local_vars();
+    ast->scope = get_scope();
+    end_local_vars();
     return ast;
 }
 
+// 初期値を組み立てる途中のバイト列
+struct init_buf {
+    char *data;
+    int size;
+    struct vector *relocs;
+};
+
+static void reserve_init(struct init_buf *buf, int size)
+{
+    if (buf->size < size) {
+        buf->data = realloc(buf->data, size);
+        memset(buf->data + buf->size, 0, size - buf->size);
+        buf->size = size;
+    }
+}
+
+// アドレス定数を含まず、すべてのバイトが 0 の初期値かどうか
+static bool is_zero_init(struct init_buf *buf)
+{
+    if (buf->relocs->size) {
+        return false;
+    }
+    for (int i = 0; i < buf->size; i++) {
+        if (buf->data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 初期値の式をコンパイル時に評価する
+// アドレス定数の場合は、その元になるグローバル変数か文字列リテラルを reloc に入れ、val をそこからのバイト数にする
+static void eval_const(struct ast *ast, long *val, struct reloc *reloc)
+{
+    switch (ast->kind) {
+    case AST_NUM:
+        *val = ast->val;
+        return;
+    case AST_STRING:
+        *val = 0;
+        reloc->string_index = ast->string_index;
+        return;
+    case AST_GVAR:
+        // 配列は先頭要素のアドレスになる
+        if (ast->type->bt != T_ARRAY) {
+            break;
+        }
+        *val = 0;
+        reloc->var = ast->var;
+        return;
+    case AST_ADDR:
+        if (ast->lhs->kind == AST_GVAR) {
+            *val = 0;
+            reloc->var = ast->lhs->var;
+            return;
+        }
+        if (ast->lhs->kind == AST_DEREF) {
+            eval_const(ast->lhs->lhs, val, reloc);
+            return;
+        }
+        break;
+    case AST_ADD_PTR: {
+        long index;
+        struct reloc r = {0, NULL, -1};
+        eval_const(ast->rhs, &index, &r);
+        if (r.var || r.string_index >= 0) {
+            break;
+        }
+        eval_const(ast->lhs, val, reloc);
+        *val += index * ast->type->ptr_to->nbyte;
+        return;
+    }
+    case AST_ADD:
+    case AST_SUB:
+    case AST_MUL:
+    case AST_DIV:
+    case AST_EQ:
+    case AST_NE:
+    case AST_LT:
+    case AST_LE: {
+        long l, r;
+        struct reloc rl = {0, NULL, -1};
+        struct reloc rr = {0, NULL, -1};
+        eval_const(ast->lhs, &l, &rl);
+        eval_const(ast->rhs, &r, &rr);
+        if (rl.var || rl.string_index >= 0 || rr.var || rr.string_index >= 0) {
+            break;
+        }
+        switch (ast->kind) {
+        case AST_ADD:
+            *val = l + r;
+            return;
+        case AST_SUB:
+            *val = l - r;
+            return;
+        case AST_MUL:
+            *val = l * r;
+            return;
+        case AST_DIV:
+            if (r == 0) {
+                error_token("初期値の式で 0 で割っています");
+            }
+            *val = l / r;
+            return;
+        case AST_EQ:
+            *val = l == r;
+            return;
+        case AST_NE:
+            *val = l != r;
+            return;
+        case AST_LT:
+            *val = l < r;
+            return;
+        default:
+            *val = l <= r;
+            return;
+        }
+    }
+    }
+    error_token("初期値がコンパイル時に決まる式ではありません");
+}
+
+// type 型の初期値を読み、buf の offset バイト目から書き込む
+// 要素数を省略した配列の場合は、初期値の要素数を返す
+static int parse_initializer(struct init_buf *buf, struct type *type, int offset)
+{
+    if (type->bt == T_ARRAY) {
+        int tok;
+        if (type->ptr_to->bt == T_CHAR && (tok = consume_token(TK_STRING))) {
+            // 配列に収まる場合は終端の \0 も書き込む
+            int len = strlen(token_string(tok)) + 1;
+            int size = type->array_size < 0 ? len : type->array_size;
+            if (len - 1 > size) {
+                error_token("文字列が配列に収まりません");
+            }
+            reserve_init(buf, offset + size);
+            memcpy(buf->data + offset, token_string(tok), len - 1 < size ? len : size);
+            return len;
+        }
+
+        expect_token(TK_LBRACE);
+        int n = 0;
+        while (!consume_token(TK_RBRACE)) {
+            if (n > 0) {
+                expect_token(TK_COLON);
+                if (consume_token(TK_RBRACE)) {
+                    break;
+                }
+            }
+            if (type->array_size >= 0 && n >= type->array_size) {
+                error_token("初期値の要素が多すぎます");
+            }
+            parse_initializer(buf, type->ptr_to, offset + n * type->ptr_to->nbyte);
+            n++;
+        }
+        reserve_init(buf, offset + (type->array_size < 0 ? n : type->array_size) * type->ptr_to->nbyte);
+        return n;
+    }
+
+    long val;
+    struct reloc reloc = {offset, NULL, -1};
+    eval_const(parse_expr(), &val, &reloc);
+    reserve_init(buf, offset + type->nbyte);
+    if (reloc.var || reloc.string_index >= 0) {
+        if (type->bt != T_PTR) {
+            error_token("ポインタでない変数をアドレスで初期化しています");
+        }
+        struct reloc *r = calloc(1, sizeof(struct reloc));
+        *r = reloc;
+        r->addend = val;
+        vector_push_back(buf->relocs, r);
+        return 1;
+    }
+    // 実行時の書き込みと同じく、型の大きさに切り詰める (リトルエンディアン)
+    for (int i = 0; i < type->nbyte; i++) {
+        buf->data[offset + i] = (val >> (8 * i)) & 0xff;
+    }
+    return 1;
+}
+
 static void parse_global_var(void)
 {
+    // グローバル変数は関数ごとに解放する領域に置かない
+    struct arena *saved = set_arena(NULL);
+
     struct type *type = parse_type();
-    struct token *ident = expect_token(TK_IDENT);
+    int ident = expect_token(TK_IDENT);
     type = parse_type_postfix(type);
-    // todo: グローバル変数の初期値
-    expect_token(TK_SCOLON);
     if (find_global_var(ident)) {
         error_token("すでに定義されているグローバル変数です");
     }
-    add_global_var(ident, type);
+
+    struct init_buf buf = {NULL, 0, new_vector()};
+    if (consume_token(TK_ASSIGN)) {
+        int n = parse_initializer(&buf, type, 0);
+        if (type->bt == T_ARRAY && type->array_size < 0) {
+            type = array_type(type->ptr_to, n);
+        }
+    }
+    if (type->bt == T_ARRAY && type->array_size < 0) {
+        error_token("配列の要素数が決まりません");
+    }
+    expect_token(TK_SCOLON);
+
+    // 0 で初期化するものは初期値のないものと同じく .bss に置く
+    if (is_zero_init(&buf)) {
+        free(buf.data);
+        buf.data = NULL;
+    }
+
+    struct var *var = add_global_var(ident, type);
+    var->init_data = buf.data;
+    var->relocs = buf.relocs;
+    set_arena(saved);
 }
 
+// 文を読み、その文が始まる行番号を記録する
 static struct ast *parse_stmt(void)
+{
+    int line = token_line(get_token());
+    struct ast *ast = parse_stmt_node();
+    ast->line = line;
+    return ast;
+}
+
+static struct ast *parse_stmt_node(void)
 {
     if (consume_token(TK_RETURN)) {
         struct ast *lhs = parse_expr();
@@ -190,18 +415,24 @@ static struct ast *parse_stmt(void)
     if (consume_token(TK_LBRACE)) {
         struct ast *ast = new_ast(AST_BLOCK, NULL);
         ast->stmts = new_vector();
+        enter_scope();
+        ast->scope = get_scope();
         while (!consume_token(TK_RBRACE)) {
             vector_push_back(ast->stmts, (void *)parse_stmt());
         }
+        leave_scope();
         return ast;
     }
 
     struct type *type = parse_type();
     if (type) {
         struct ast *ast = new_ast(AST_VARDECL, NULL);
-        struct token *tok = consume_token(TK_IDENT);
+        int tok = consume_token(TK_IDENT);
         type = parse_type_postfix(type);
-        struct var *lvar = find_local_var(tok);
+        if (type->bt == T_ARRAY && type->array_size < 0) {
+            error_token("ローカル変数の配列の要素数は省略できません");
+        }
+        struct var *lvar = find_scope_var(tok);
         if (lvar) {
             error_token("変数を重複して宣言しています");
         }
@@ -217,93 +448,60 @@ static struct ast *parse_stmt(void)
 
 static struct ast *parse_expr(void)
 {
-    return parse_assign();
+    return parse_binary(1);
 }
 
-static struct ast *parse_assign(void)
+// 二項演算子の表。prec が大きいほど強く結びつき、0 は二項演算子でないことを表す
+// 演算子を増やすときはここに 1 行足すだけでよく、構文解析の関数の呼び出しは深くならない
+static struct binary_op {
+    int prec;
+    bool right_assoc;
+    enum ast_kind kind;
+    bool swap; // 左右を入れ替えて kind のノードにする (a > b は b < a)
+} binary_ops[TK_EOF + 1] = {
+    [TK_ASSIGN] = {1, true, AST_ASSIGN},
+    [TK_EQ] = {2, false, AST_EQ},
+    [TK_NE] = {2, false, AST_NE},
+    [TK_LT] = {3, false, AST_LT},
+    [TK_LE] = {3, false, AST_LE},
+    [TK_GT] = {3, false, AST_LT, true},
+    [TK_GE] = {3, false, AST_LE, true},
+    [TK_PLUS] = {4, false, AST_ADD},
+    [TK_MINUS] = {4, false, AST_SUB},
+    [TK_MUL] = {5, false, AST_MUL},
+    [TK_DIV] = {5, false, AST_DIV},
+};
+
+static struct ast *new_ast_binary_op(struct binary_op *op, struct ast *lhs, struct ast *rhs)
 {
-    struct ast *ast = parse_equality();
-    if (consume_token(TK_ASSIGN)) {
-        struct ast *rhs = parse_assign();
-        ast = new_ast_binary(AST_ASSIGN, rhs->type, ast, rhs);
+    if (op->kind == AST_ASSIGN) {
+        return new_ast_binary(AST_ASSIGN, rhs->type, lhs, rhs);
     }
-    return ast;
-}
-
-static struct ast *parse_equality(void)
-{
-    struct ast *ast = parse_relational();
-    while (1) {
-        if (consume_token(TK_EQ)) {
-            ast = new_ast_binary(AST_EQ, int_type(), ast, parse_relational());
-        }
-        else if (consume_token(TK_NE)) {
-            ast = new_ast_binary(AST_NE, int_type(), ast, parse_relational());
-        }
-        else {
-            return ast;
-        }
+    // ポインタと整数の足し算
+    // todo: ポインタが左辺に来る場合しか取り扱っていない
+    if (op->kind == AST_ADD && lhs->type && lhs->type->ptr_to) {
+        return new_ast_add_ptr(lhs, rhs);
     }
-}
-
-static struct ast *parse_relational(void)
-{
-    struct ast *ast = parse_add();
-    while (1) {
-        if (consume_token(TK_LT)) {
-            ast = new_ast_binary(AST_LT, int_type(), ast, parse_add());
-        }
-        else if (consume_token(TK_LE)) {
-            ast = new_ast_binary(AST_LE, int_type(), ast, parse_add());
-        }
-        else if (consume_token(TK_GT)) {
-            ast = new_ast_binary(AST_LT, int_type(), parse_add(), ast);
-        }
-        else if (consume_token(TK_GE)) {
-            ast = new_ast_binary(AST_LE, int_type(), parse_add(), ast);
-        }
-        else {
-            return ast;
-        }
+    if (op->swap) {
+        return new_ast_binary(op->kind, int_type(), rhs, lhs);
     }
+    return new_ast_binary(op->kind, int_type(), lhs, rhs);
 }
 
-static struct ast *parse_add(void)
-{
-    struct ast *ast = parse_mul();
-    while (1) {
-        if (consume_token(TK_PLUS)) {
-            // ポインタと整数の足し算
-            // todo: ポインタが左辺に来る場合しか取り扱っていない
-            if (ast->kind == AST_LVAR && (ast->var->type->bt == T_PTR || ast->var->type->bt == T_ARRAY)) {
-                ast = new_ast_binary(AST_ADD_PTR, ast->var->type, ast, parse_mul());
-            }
-            else {
-                ast = new_ast_binary(AST_ADD, int_type(), ast, parse_mul());
-            }
-        }
-        else if (consume_token(TK_MINUS)) {
-            ast = new_ast_binary(AST_SUB, int_type(), ast, parse_mul());
-        }
-        else {
-            return ast;
-        }
-    }
-}
-
-static struct ast *parse_mul(void)
+// 優先順位が min_prec 以上の二項演算子だけからなる式を読む (precedence climbing)
+// 左結合の演算子では右辺を 1 つ強い優先順位で読み、右結合の演算子では同じ優先順位で読む
+static struct ast *parse_binary(int min_prec)
 {
     struct ast *ast = parse_unary();
     while (1) {
-        if (consume_token(TK_MUL)) {
-            ast = new_ast_binary(AST_MUL, int_type(), ast, parse_unary());
-        }
-        else if (consume_token(TK_DIV)) {
-            ast = new_ast_binary(AST_DIV, int_type(), ast, parse_unary());
-        }
-        else {
+        enum token_kind kind = peek_token();
+        struct binary_op *op = &binary_ops[kind];
+        if (!op->prec || op->prec < min_prec) {
             return ast;
         }
+        consume_token(kind);
+        struct ast *rhs = parse_binary(op->right_assoc ? op->prec : op->prec + 1);
+        ast = new_ast_binary_op(op, ast, rhs);
     }
 }
 
@@ -311,8 +509,7 @@ static struct ast *parse_unary(void)
 {
     struct ast *lhs;
     if (consume_token(TK_MUL)) {
-        lhs = parse_unary();
-        return new_ast_unary(AST_DEREF, deref_type(lhs->type), lhs);
+        return new_ast_deref(parse_unary());
     }
     if (consume_token(TK_AND)) {
         lhs = parse_unary();
@@ -334,7 +531,7 @@ static struct ast *parse_unary(void)
 static struct ast *parse_primary(void)
 {
     struct ast *ast;
-    struct token *tok;
+    int tok;
 
     if (consume_token(TK_LPAREN)) {
         ast = parse_expr();
@@ -345,8 +542,7 @@ static struct ast *parse_primary(void)
     tok = consume_token(TK_STRING);
     if (tok) {
         ast = new_ast(AST_STRING, ptr_type(char_type()));
-        ast->string_index = string_literals->size;
-        vector_push_back(string_literals, tok->string);
+        ast->string_index = intern_string(token_string(tok));
         return ast;
     }
 
@@ -370,8 +566,7 @@ static struct ast *parse_primary(void)
             ast = new_ast(AST_LVAR, var->type);
             ast->var = var;
             if (consume_token(TK_LBRACKET)) {
-                struct ast *add = new_ast_binary(AST_ADD_PTR, int_type(), ast, parse_expr());
-                ast = new_ast_unary(AST_DEREF, deref_type(var->type), add);
+                ast = new_ast_deref(new_ast_add_ptr(ast, parse_expr()));
                 expect_token(TK_RBRACKET);
             }
             return ast;
@@ -381,8 +576,7 @@ static struct ast *parse_primary(void)
             ast = new_ast(AST_GVAR, var->type);
             ast->var = var;
             if (consume_token(TK_LBRACKET)) {
-                struct ast *add = new_ast_binary(AST_ADD_PTR, int_type(), ast, parse_expr());
-                ast = new_ast_unary(AST_DEREF, deref_type(var->type), add);
+                ast = new_ast_deref(new_ast_add_ptr(ast, parse_expr()));
                 expect_token(TK_RBRACKET);
             }
             return ast;
@@ -393,13 +587,44 @@ static struct ast *parse_primary(void)
     tok = consume_token(TK_NUM);
     if (tok) {
         ast = new_ast(AST_NUM, int_type());
-        ast->val = tok->val;
+        ast->val = token_val(tok);
         return ast;
     }
 
     error_token("パーズできません");
 }
 
+// 同じ内容の文字列リテラルは 1 つにまとめ、その番号を返す
+static int intern_string(char *str)
+{
+    for (int i = 0; i < string_literals->size; i++) {
+        if (!strcmp(string_literals->data[i], str)) {
+            return i;
+        }
+    }
+    vector_push_back(string_literals, str);
+    return string_literals->size - 1;
+}
+
+// ptr + index のノードを作る
+// 配列は先頭要素へのポインタとして扱い、index は要素の大きさ倍される
+static struct ast *new_ast_add_ptr(struct ast *ptr, struct ast *index)
+{
+    if (!ptr->type || !ptr->type->ptr_to) {
+        error_token("ポインタでも配列でもない値に添字を付けています");
+    }
+    return new_ast_binary(AST_ADD_PTR, ptr_type(deref_type(ptr->type)), ptr, index);
+}
+
+// *addr のノードを作る
+static struct ast *new_ast_deref(struct ast *addr)
+{
+    if (!addr->type || !addr->type->ptr_to) {
+        error_token("ポインタでない値を参照しています");
+    }
+    return new_ast_unary(AST_DEREF, deref_type(addr->type), addr);
+}
+
 static struct vector *parse_arglist(void)
 {
     struct vector *args = new_vector();
@@ -431,8 +656,13 @@ static struct type *parse_type(void)
 static struct type *parse_type_postfix(struct type *type)
 {
     while (consume_token(TK_LBRACKET)) {
-        struct token *num = expect_token(TK_NUM); // todo: 配列数は定数のみ可
-        type = array_type(type, num->val);
+        // 要素数を省略した配列 (初期値から決める) は array_size を -1 にしておく
+        if (consume_token(TK_RBRACKET)) {
+            type = array_type(type, -1);
+            continue;
+        }
+        int num = expect_token(TK_NUM); // todo: 配列数は定数のみ可
+        type = array_type(type, token_val(num));
         expect_token(TK_RBRACKET);
     }
     return type;
@@ -0,0 +1,133 @@
+#include "rehabcc.h"
+
+// プロファイルによる最適化
+// 構文解析直後の構文木の分岐・ループ・関数・呼び出しに番号を振り、番号ごとに 2 つのカウンタを持つ
+//   PROF_ENTRY: そのノードに到達した回数 (関数は呼ばれた回数)
+//   PROF_TAKEN: if の then 側に進んだ回数、ループ本体を実行した回数
+// 最適化で複製されたノードは同じ番号を持つので、複製先の実行回数の合計が元のノードの実行回数になる
+//
+// -fprofile-generate で出力したプログラムは、終了時にカウンタをファイルに書き出す
+// ファイルの中身は [入力の指紋, 番号の数, カウンタ...] の 64 bit 整数の列
+// -fprofile-use は同じ入力から番号を振り直してファイルを読み、指紋が一致すれば使う
+
+static int nprofile_ids;
+static long *counts; // 読み込んだカウンタ (プロファイルを使わない場合は NULL)
+static long max_call_count;
+
+static void assign_child(struct ast **ast, void *arg)
+{
+    struct ast *node = *ast;
+    switch (node->kind) {
+    case AST_FUNCTION:
+    case AST_IF:
+    case AST_WHILE:
+    case AST_FOR:
+    case AST_FUNCALL:
+        node->prof_id = ++nprofile_ids;
+        break;
+    }
+    walk_ast_children(node, assign_child, arg);
+}
+
+void assign_profile_ids(void)
+{
+    struct vector *funcs = get_all_ast();
+    for (int i = 0; i < funcs->size; i++) {
+        assign_child((struct ast **)&funcs->data[i], NULL);
+    }
+}
+
+int profile_size(void)
+{
+    return nprofile_ids;
+}
+
+// 入力と振った番号の数から作る、プロファイルとソースの対応を確かめるための値 (FNV-1a)
+long profile_checksum(void)
+{
+    unsigned long h = 14695981039346656037UL;
+    for (char *p = user_input; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 1099511628211UL;
+    }
+    h = (h ^ nprofile_ids) * 1099511628211UL;
+    return h >> 1; // .quad に 10 進数で書くので正の値にする
+}
+
+static void find_max_call(struct ast **ast, void *arg)
+{
+    struct ast *node = *ast;
+    if (node->kind == AST_FUNCALL && node->prof_id) {
+        long n = profile_count(node, PROF_ENTRY);
+        if (max_call_count < n) {
+            max_call_count = n;
+        }
+    }
+    walk_ast_children(node, find_max_call, arg);
+}
+
+// プロファイルが入力と対応しない場合は警告して使わない
+void read_profile(char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "警告: プロファイル %s を開けません: %s\n", path, strerror(errno));
+        return;
+    }
+    long header[2];
+    int n = 2 * nprofile_ids;
+    long *buf = calloc(n + 1, sizeof(long));
+    if (fread(header, sizeof(long), 2, fp) != 2 || header[0] != profile_checksum() || header[1] != nprofile_ids ||
+        fread(buf, sizeof(long), n, fp) != n) {
+        fprintf(stderr, "警告: プロファイル %s は入力と対応していません\n", path);
+        free(buf);
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+    counts = buf;
+
+    struct vector *funcs = get_all_ast();
+    for (int i = 0; i < funcs->size; i++) {
+        find_max_call((struct ast **)&funcs->data[i], NULL);
+    }
+}
+
+// カウンタの値。プロファイルがない場合やノードに番号がない場合は -1
+long profile_count(struct ast *node, int which)
+{
+    if (!counts || !node->prof_id) {
+        return -1;
+    }
+    return counts[2 * (node->prof_id - 1) + which];
+}
+
+// 一度も実行されなかったノード
+bool is_cold(struct ast *node)
+{
+    return profile_count(node, PROF_ENTRY) == 0;
+}
+
+// 最も多く実行された呼び出しの 1/8 以上実行された呼び出し
+bool is_hot_call(struct ast *node)
+{
+    long n = profile_count(node, PROF_ENTRY);
+    return n > 0 && n * 8 >= max_call_count;
+}
+
+// if の then 側と else 側のうち、めったに (1/8 未満しか) 実行されない方
+// 0 ならどちらでもない、1 なら then 側、2 なら else 側
+int unlikely_branch(struct ast *node)
+{
+    long entry = profile_count(node, PROF_ENTRY);
+    long taken = profile_count(node, PROF_TAKEN);
+    if (entry <= 0) {
+        return 0;
+    }
+    if (taken * 8 < entry) {
+        return 1;
+    }
+    if ((entry - taken) * 8 < entry) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "rehabcc.h"
+
+// 関数呼び出しをまたいでも値が保存されるレジスタ
+// 使う場合は関数の入口で退避して出口で復元する
+static char *callee_saved[] = {"rbx", "r12", "r13", "r14", "r15"};
+
+// 葉関数で使える退避不要のレジスタ
+// 式の評価には rax, rdi, rdx しか使わないので、引数を受け取った後はこれらが空く
+static char *scratch[] = {"rsi", "rcx", "r8", "r9", "r10", "r11"};
+
+// 引数を受け取るレジスタ
+static char *arg_regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+
+// 昇格候補の変数と、ループの深さで重み付けした使用回数
+struct candidate {
+    struct var *var;
+    int weight;
+    bool addr_taken;
+};
+
+struct usage {
+    struct candidate *cands;
+    int ncands;
+    int loop_weight;
+};
+
+static struct candidate *find_candidate(struct usage *u, struct var *var)
+{
+    for (int i = 0; i < u->ncands; i++) {
+        if (u->cands[i].var == var) {
+            return &u->cands[i];
+        }
+    }
+    return NULL;
+}
+
+static void count_usage(struct ast **node, void *arg)
+{
+    struct usage *u = arg;
+    struct ast *ast = *node;
+
+    switch (ast->kind) {
+    case AST_LVAR: {
+        struct candidate *c = find_candidate(u, ast->var);
+        if (c) {
+            c->weight += u->loop_weight;
+        }
+        return;
+    }
+    case AST_ADDR: {
+        // アドレスを取られた変数はメモリ上に置く必要がある
+        if (ast->lhs->kind == AST_LVAR) {
+            struct candidate *c = find_candidate(u, ast->lhs->var);
+            if (c) {
+                c->addr_taken = true;
+            }
+            return;
+        }
+        break;
+    }
+    case AST_WHILE:
+    case AST_FOR:
+    case AST_VLOOP: {
+        // ループ内の使用は何度も実行されるので重く数える
+        int saved = u->loop_weight;
+        if (u->loop_weight < 1000000) {
+            u->loop_weight *= 8;
+        }
+        walk_ast_children(ast, count_usage, u);
+        u->loop_weight = saved;
+        return;
+    }
+    }
+    walk_ast_children(ast, count_usage, u);
+}
+
+static bool is_scalar(struct type *type)
+{
+    return type->bt == T_CHAR || type->bt == T_INT || type->bt == T_PTR;
+}
+
+static int param_index(struct ast *func, struct var *var)
+{
+    for (int i = 0; i < func->params->size; i++) {
+        if (func->params->data[i] == var) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool contains(char **regs, int n, char *reg)
+{
+    for (int i = 0; i < n; i++) {
+        if (!strcmp(regs[i], reg)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// アドレスを取られないスカラー変数を、使用回数の多い順にレジスタへ割り当てる
+// 割り当てた変数は var->reg にレジスタ名が入り、スタック上には置かれない
+// 退避が必要になった callee-saved レジスタは func->saved_regs に入る
+void allocate_registers(struct ast *func)
+{
+    struct usage u = {0};
+    int nvars = 0;
+    for (struct var *var = func->locals; var; var = var->next) {
+        var->reg = NULL;
+        nvars++;
+    }
+    func->saved_regs = new_vector();
+    if (!promote_registers) {
+        return;
+    }
+
+    u.cands = arena_alloc(nvars * sizeof(struct candidate));
+    for (struct var *var = func->locals; var; var = var->next) {
+        if (is_scalar(var->type)) {
+            u.cands[u.ncands++].var = var;
+        }
+    }
+    u.loop_weight = 1;
+    walk_ast_children(func, count_usage, &u);
+
+    // 重みの大きい順に並べる (挿入ソート)
+    for (int i = 1; i < u.ncands; i++) {
+        struct candidate c = u.cands[i];
+        int j = i;
+        while (j > 0 && u.cands[j - 1].weight < c.weight) {
+            u.cands[j] = u.cands[j - 1];
+            j--;
+        }
+        u.cands[j] = c;
+    }
+
+    // 使えるレジスタを決める
+    // 葉関数では引数レジスタをそのまま仮引数の置き場所にできる。
+    // それ以外の変数には、まだ読まれていない引数を壊さないよう、引数の渡されていない
+    // レジスタか、自分自身の引数レジスタ (rdi, rdx 以外) だけを使う
+    char *pool[16];
+    int npool = 0;
+    char *own[6] = {0};
+    bool leaf = is_leaf(func);
+    if (leaf) {
+        for (int i = 0; i < u.ncands; i++) {
+            struct candidate *c = &u.cands[i];
+            int idx = param_index(func, c->var);
+            if (!c->addr_taken && idx >= 0 && contains(scratch, 6, arg_regs[idx])) {
+                own[idx] = arg_regs[idx];
+            }
+        }
+        for (int i = 0; i < 6; i++) {
+            int idx = -1;
+            for (int j = 0; j < 6; j++) {
+                if (!strcmp(arg_regs[j], scratch[i])) {
+                    idx = j;
+                }
+            }
+            if (idx < 0 || idx >= func->params->size) {
+                pool[npool++] = scratch[i];
+            }
+        }
+    }
+    for (int i = 0; i < 5; i++) {
+        pool[npool++] = callee_saved[i];
+    }
+
+    int next = 0;
+    for (int i = 0; i < u.ncands; i++) {
+        struct candidate *c = &u.cands[i];
+        if (c->addr_taken || c->weight == 0) {
+            continue;
+        }
+        int idx = param_index(func, c->var);
+        if (idx >= 0 && own[idx]) {
+            c->var->reg = own[idx];
+            continue;
+        }
+        if (next == npool) {
+            continue;
+        }
+        c->var->reg = pool[next++];
+        if (contains(callee_saved, 5, c->var->reg)) {
+            vector_push_back(func->saved_regs, c->var->reg);
+        }
+    }
+}
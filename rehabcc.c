@@ -1,8 +1,5 @@
 #include "rehabcc.h"
 
-// 現在着目しているトークン
-struct token *token;
-
 // 入力ファイル
 char *filename;
 
@@ -10,11 +7,39 @@ char *filename;
 char *user_input;
 
 // 構文木列
-struct vector *asts;
+extern struct vector *asts;
 
 // 文字列リテラル
 struct vector *string_literals;
 
+// コマンドラインオプション
+bool omit_frame_pointer;
+bool promote_registers;
+bool inline_functions;
+int inline_limit = 40;
+bool sibling_calls;
+bool loop_invariants;
+bool ivopts;
+bool ccp;
+bool dse;
+bool cse;
+bool vectorize;
+bool avx2;
+bool unroll;
+int unroll_factor = 4;
+int unroll_limit = 200;
+bool eval_pure_calls;
+int eval_limit = 1000000;
+bool whole_program;
+struct vector *exported_symbols;
+char *profile_generate;
+char *profile_use;
+bool debug_info;
+bool run_bytecode;
+bool streaming;
+int lex_chunks;
+char *scan_kernel;
+
 void error(char *fmt, ...)
 {
     va_list ap;
@@ -71,7 +96,8 @@ char *read_file(char *path)
         error("%s: fseek: %s", path, strerror(errno));
     }
 
-    char *buf = calloc(1, size + 2);
+    // 末尾の改行と '\0'、字句解析でまとめて読む分の余白
+    char *buf = calloc(1, size + 2 + SCAN_PADDING);
     fread(buf, size, 1, fp);
     if (size == 0 || buf[size - 1] != '\n') {
         buf[size++] = '\n';
@@ -81,21 +107,249 @@ char *read_file(char *path)
     return buf;
 }
 
-int main(int argc, char **argv)
+// -f オプションの一覧
+// -O で指定した最適化レベルが level 以上なら有効になる。-fname/-fno-name で個別に上書きできる
+struct flag_option {
+    char *name;
+    bool *flag;
+    int level;
+};
+
+static struct flag_option flag_options[] = {
+    {"omit-frame-pointer", &omit_frame_pointer, 1},
+    {"promote-registers", &promote_registers, 1},
+    {"inline-functions", &inline_functions, 2},
+    {"ccp", &ccp, 1},
+    {"dse", &dse, 1},
+    {"optimize-sibling-calls", &sibling_calls, 2},
+    {"move-loop-invariants", &loop_invariants, 2},
+    {"ivopts", &ivopts, 2},
+    {"vectorize", &vectorize, 2},
+    {"cse", &cse, 2},
+    {"unroll-loops", &unroll, 2},
+    {"eval-pure-calls", &eval_pure_calls, 2},
+    {"whole-program", &whole_program, 1},
+    {NULL},
+};
+
+// 値をとるオプション -name=value
+struct int_option {
+    char *name;
+    int *value;
+};
+
+static struct int_option int_options[] = {
+    {"-finline-limit=", &inline_limit},
+    {"-funroll-factor=", &unroll_factor},
+    {"-funroll-limit=", &unroll_limit},
+    {"-feval-limit=", &eval_limit},
+    {"-flex-chunks=", &lex_chunks},
+    {NULL},
+};
+
+// -m オプション (使ってよい命令セット)。-mname/-mno-name で指定する
+struct target_option {
+    char *name;
+    bool *flag;
+};
+
+static struct target_option target_options[] = {
+    {"avx2", &avx2},
+    {NULL},
+};
+
+static bool parse_flag_option(char *arg, bool *explicit)
+{
+    bool value = true;
+    if (!strncmp(arg, "-fno-", 5)) {
+        arg += 5;
+        value = false;
+    }
+    else if (!strncmp(arg, "-f", 2)) {
+        arg += 2;
+    }
+    else {
+        return false;
+    }
+    for (int i = 0; flag_options[i].name; i++) {
+        if (!strcmp(arg, flag_options[i].name)) {
+            *flag_options[i].flag = value;
+            explicit[i] = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_target_option(char *arg)
 {
-    if (argc != 2) {
-        fprintf(stderr, "引数の個数が正しくありません\n");
-        return 1;
+    bool value = true;
+    if (!strncmp(arg, "-mno-", 5)) {
+        arg += 5;
+        value = false;
     }
+    else if (!strncmp(arg, "-m", 2)) {
+        arg += 2;
+    }
+    else {
+        return false;
+    }
+    for (int i = 0; target_options[i].name; i++) {
+        if (!strcmp(arg, target_options[i].name)) {
+            *target_options[i].flag = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_int_option(char *arg)
+{
+    for (int i = 0; int_options[i].name; i++) {
+        int len = strlen(int_options[i].name);
+        if (!strncmp(arg, int_options[i].name, len)) {
+            char *end;
+            *int_options[i].value = strtol(arg + len, &end, 10);
+            if (end == arg + len || *end) {
+                error("オプションの値が不正です: %s", arg);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static void parse_args(int argc, char **argv)
+{
+    int opt_level = 1;
+    bool explicit[sizeof(flag_options) / sizeof(flag_options[0])] = {0};
+
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "-O", 2) && isdigit(argv[i][2]) && !argv[i][3]) {
+            opt_level = argv[i][2] - '0';
+        }
+        else if (!strcmp(argv[i], "-g")) {
+            debug_info = true;
+        }
+        else if (!strcmp(argv[i], "-run")) {
+            run_bytecode = true;
+        }
+        else if (!strcmp(argv[i], "-stream")) {
+            streaming = true;
+        }
+        else if (!strcmp(argv[i], "-fprofile-generate")) {
+            profile_generate = "rehabcc.prof";
+        }
+        else if (!strncmp(argv[i], "-fprofile-generate=", 19)) {
+            profile_generate = argv[i] + 19;
+        }
+        else if (!strcmp(argv[i], "-fprofile-use")) {
+            profile_use = "rehabcc.prof";
+        }
+        else if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+            profile_use = argv[i] + 14;
+        }
+        else if (!strncmp(argv[i], "-fexport=", 9)) {
+            vector_push_back(exported_symbols, argv[i] + 9);
+        }
+        else if (!strncmp(argv[i], "-fscan=", 7)) {
+            scan_kernel = argv[i] + 7;
+        }
+        else if (parse_flag_option(argv[i], explicit) || parse_target_option(argv[i]) || parse_int_option(argv[i])) {
+            continue;
+        }
+        else if (argv[i][0] == '-') {
+            error("不明なオプションです: %s", argv[i]);
+        }
+        else if (filename) {
+            error("入力ファイルは1つだけ指定できます");
+        }
+        else {
+            filename = argv[i];
+        }
+    }
+    if (!filename) {
+        error("引数の個数が正しくありません");
+    }
+
+    for (int i = 0; flag_options[i].name; i++) {
+        if (!explicit[i]) {
+            *flag_options[i].flag = opt_level >= flag_options[i].level;
+        }
+    }
+    // ベクトル化したループは x86-64 の SIMD 命令としてしか実行できない
+    if (run_bytecode) {
+        vectorize = false;
+    }
+    // ループの形を変える最適化をすると、ループ本体の実行回数を元のループの回数として数えられない
+    if (profile_generate) {
+        unroll = false;
+        vectorize = false;
+    }
+    // 関数を 1 つずつ処理する場合は、他の関数の本体を見る最適化はできない
+    if (streaming) {
+        if (run_bytecode || profile_generate || profile_use) {
+            error("-stream は -run や -fprofile-generate, -fprofile-use と同時に指定できません");
+        }
+        inline_functions = false;
+        eval_pure_calls = false;
+        whole_program = false;
+    }
+}
+
+// 関数を 1 つ読むごとに最適化して出力し、その関数のために確保した領域とトークンを解放する
+// グローバル変数と文字列リテラルは最後にまとめて出力する
+static void compile_streaming(void)
+{
+    struct arena *arena = new_arena();
+    tokenize_lazily();
+    gen_header();
+    for (;;) {
+        set_arena(arena);
+        struct ast *func = parse_next_function();
+        if (!func) {
+            break;
+        }
+        add_ast(func);
+        optimize();
+        gen_function(func);
+        get_all_ast()->size = 0;
+        set_arena(NULL);
+        clear_arena(arena);
+        discard_tokens();
+    }
+    set_arena(NULL);
+    gen_data();
+}
+
+int main(int argc, char **argv)
+{
+    exported_symbols = new_vector();
+    parse_args(argc, argv);
 
     asts = new_vector();
     string_literals = new_vector();
 
+    user_input = read_file(filename);
+    if (streaming) {
+        compile_streaming();
+        return 0;
+    }
+
     // トークン分割
-    filename = argv[1];
-    user_input = read_file(argv[1]);
     tokenize();
     parse();
+    // 最適化で構文木が変わる前に番号を振り、計測時と読み込み時で同じ番号にする
+    if (profile_generate || profile_use) {
+        assign_profile_ids();
+    }
+    if (profile_use) {
+        read_profile(profile_use);
+    }
+    optimize();
+    if (run_bytecode) {
+        return run_program();
+    }
     generate();
 
     return 0;
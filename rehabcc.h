@@ -1,9 +1,11 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <memory.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,17 +13,34 @@
 // util.c ///////////////////////////////////////
 
 int align(int, int);
+char *format(char *, ...);
+
+// arena_alloc でこの大きさを超える領域は、塊から切り出さずに個別に確保する
+#define ARENA_LARGE (16 * 1024)
+struct arena;
+void *arena_alloc(size_t);
+void *arena_alloc_in(struct arena *, size_t);
+struct arena *get_arena(void);
+struct arena *new_arena(void);
+struct arena *set_arena(struct arena *);
+void clear_arena(struct arena *);
 
 // vector.c /////////////////////////////////////
 
+// 要素数が VECTOR_SMALL 以下の間は構造体の中の small に要素を置く
+#define VECTOR_SMALL 2
+
 struct vector {
     void **data;
     int size;
     int cap;
+    struct arena *arena; // ベクタを作ったときの領域。要素の領域もここから確保する
+    void *small[VECTOR_SMALL];
 };
 
 struct vector *new_vector(void);
 void vector_push_back(struct vector *vec, void *data);
+bool vector_contains(struct vector *vec, void *p);
 
 // token.c //////////////////////////////////////
 
@@ -60,22 +79,36 @@ enum token_kind {
     TK_EOF,      // 入力終わり
 };
 
-struct token {
-    enum token_kind kind; // トークン種別
-    struct token *next;   // 次のトークン
-    char *str;            // トークンの元となる文字列の開始位置
-    int len;              // トークンの元となる文字列の長さ
-    int val;              // 整数トークンの値
-    char *string;         // 文字列トークンの値
+// トークンの並び。項目ごとの配列に置く
+struct token_array {
+    unsigned char *kind; // トークン種別
+    int *pos;            // トークンの元となる文字列の、入力の先頭からの位置
+    int *len;            // トークンの元となる文字列の長さ
+    int *val;            // 整数トークンの値 (文字列トークンは strings の添字)
+    int size;
+    int capacity;
+    char **strings; // 文字列トークンの値
+    int nstrings;
+    int strings_capacity;
 };
 
-struct token *new_token(enum token_kind, struct token *, char *, int);
-struct token *get_token(void);
-void set_token(struct token *);
-struct token *consume_token(enum token_kind);
-struct token *expect_token(enum token_kind);
+// トークンは tokenize で作った入力全体の並びの中の番号で表す (0 はトークンなし)
+int add_token(struct token_array *, enum token_kind, char *, int);
+void set_token_string(struct token_array *, int, char *);
+void append_tokens(struct token_array *);
+void discard_tokens(void);
+char *token_str(int);
+int token_len(int);
+int token_val(int);
+char *token_string(int);
+int token_line(int);
+int get_token(void);
+void set_token(int);
+enum token_kind peek_token(void);
+int consume_token(enum token_kind);
+int expect_token(enum token_kind);
 void error_token(char *, ...);
-char *copy_token_str(struct token *);
+char *copy_token_str(int);
 
 void debug_print_token();
 
@@ -93,6 +126,7 @@ struct type {
     enum basic_type bt;
     struct type *ptr_to;
     int nbyte;
+    int align; // 整列要求 (バイト)
     int array_size;
 };
 
@@ -105,20 +139,51 @@ struct type *array_type(struct type *, int);
 
 // var.c ////////////////////////////////////////
 
+struct ast;
+
 struct var {
     struct var *next;  // 次のローカル変数またはNULL
     struct type *type; // 変数の型
     char *name;        // ローカル変数名
     int offset;        // RBP からのオフセット
+    char *reg;         // 変数を置くレジスタ (スタック上に置く場合は NULL)
+
+    // グローバル変数の初期値のバイト列 (NULL ならすべて 0) と、そのうちアドレスを置く場所 (struct reloc)
+    char *init_data;
+    struct vector *relocs;
+};
+
+// グローバル変数の初期値の中に置く、他のグローバル変数か文字列リテラルのアドレス (8 バイト)
+struct reloc {
+    int offset;       // 初期値の先頭からの位置
+    struct var *var;  // アドレスを置くグローバル変数 (NULL なら文字列リテラル)
+    int string_index; // var が NULL の場合の文字列リテラルの番号
+    long addend;      // アドレスに足すバイト数
+};
+
+// ブロックスコープ
+// 兄弟関係にあるスコープの変数は同時に生存しないので、スタック上の領域を共有できる
+struct scope {
+    struct scope *parent;    // 外側のスコープ
+    struct vector *children; // 内側のスコープ
+    struct vector *vars;     // このスコープで宣言された変数 (宣言順)
 };
 
+struct scope *new_scope(struct scope *);
 void clear_local_vars(void);
+void end_local_vars(void);
+struct scope *get_scope(void);
+void enter_scope(void);
+void leave_scope(void);
 struct var *get_local_vars(void);
-struct var *add_local_var(struct token *, struct type *);
-struct var *find_local_var(struct token *);
+struct var *add_local_var(int, struct type *);
+struct var *add_temp_var(struct ast *, struct scope *, struct type *);
+struct var *find_local_var(int);
+struct var *find_scope_var(int);
 struct var *get_global_vars(void);
-struct var *add_global_var(struct token *, struct type *);
-struct var *find_global_var(struct token *);
+struct var *add_global_var(int, struct type *);
+struct var *find_global_var(int);
+void remove_global_var(struct var *);
 
 // ast.c ////////////////////////////////////////
 
@@ -147,40 +212,68 @@ enum ast_kind {
     AST_GVAR,     // グローバル変数
     AST_ADD_PTR,  // ポインタの足し算
     AST_STRING,   // 文字列リテラル
+    AST_INLINE,   // 展開された関数呼び出し
+    AST_VLOOP,    // ベクトル化したループ
 };
 
+// ノードごとに使うフィールドは種類で決まっているので、種類の異なるフィールドは共用体で重ねる
+// new_ast は種類ごとに必要な大きさだけ確保するため、その種類で使わないフィールドを読み書きしてはいけない
 struct ast {
     enum ast_kind kind;
+    // 文と関数定義の始まる行番号 (最適化で作ったノードなど、分からない場合は 0)
+    int line;
     struct type *type;
-    struct ast *lhs;
-    struct ast *rhs;
-
-    // kind = ND_NUM の場合整数値
-    int val;
-
-    // if (cond) { then } else { els }
-    // while (cond) { stmt }
-    // for (init; cond; update) { stmt }
-    struct ast *cond;
-    struct ast *then;
-    struct ast *els;
-    struct ast *stmt;
-    struct ast *init;
-    struct ast *update;
-
-    // kind = ND_BLOCK
-    struct vector *stmts;
-
-    // kind = ND_LVAR の場合に使う
-    struct var *var;
-
-    // AST_FUNCTION, AST_FUNCALL
-    char *funcname;
-    struct var *locals;
-    struct vector *params;
-
-    // AST_STRING
-    int string_index;
+
+    union {
+        // 演算子、AST_ASSIGN、AST_RETURN、AST_ADDR、AST_DEREF、AST_ADD_PTR
+        struct {
+            struct ast *lhs;
+            struct ast *rhs;
+        };
+
+        // AST_NUM の整数値
+        int val;
+
+        // AST_LVAR, AST_GVAR
+        struct var *var;
+
+        // AST_STRING
+        int string_index;
+
+        // 制御構造と関数
+        struct {
+            // AST_FUNCTION, AST_IF, AST_WHILE, AST_FOR, AST_FUNCALL, AST_INLINE のプロファイルの番号 (0 なら計測しない)
+            int prof_id;
+
+            union {
+                // if (cond) { then } else { els }
+                // while (cond) { stmt }
+                // for (init; cond; update) { stmt }
+                // AST_VLOOP は for (init; cond; update) stmt の stmt を複数要素ずつまとめて実行し、
+                // 端数の反復は els (init を除いた元のループ) で実行する
+                struct {
+                    struct ast *cond;
+                    struct ast *then;
+                    struct ast *els;
+                    struct ast *stmt;
+                    struct ast *init;
+                    struct ast *update;
+                };
+
+                // AST_BLOCK, AST_FUNCTION, AST_FUNCALL, AST_INLINE
+                // AST_INLINE の場合は stmts が仮引数への代入と関数本体で、本体中の return で値を返す
+                struct {
+                    struct vector *stmts;
+                    struct scope *scope; // AST_FUNCTION の最も外側のスコープ、AST_BLOCK と AST_INLINE のスコープ
+                    char *funcname;
+                    struct vector *params;     // AST_FUNCTION では仮引数の変数、AST_FUNCALL では実引数の式
+                    struct var *locals;
+                    struct vector *saved_regs; // AST_FUNCTION で退避が必要な callee-saved レジスタ
+                    int stack_size;            // AST_FUNCTION のローカル変数領域の大きさ
+                };
+            };
+        };
+    };
 };
 
 void add_ast(struct ast *ast);
@@ -189,9 +282,79 @@ struct ast *new_ast(enum ast_kind, struct type *);
 struct ast *new_ast_unary(enum ast_kind, struct type *, struct ast *);
 struct ast *new_ast_binary(enum ast_kind, struct type *, struct ast *, struct ast *);
 struct ast *new_ast_num(int val);
+void walk_ast_children(struct ast *, void (*)(struct ast **, void *), void *);
+bool is_pure(struct ast *);
+bool is_leaf(struct ast *);
+bool takes_local_addr(struct ast *);
+struct vector *addr_taken_vars(struct ast *);
+int count_ast(struct ast *);
+bool same_ast(struct ast *, struct ast *);
+struct ast *copy_ast(struct ast *, struct vector *, struct vector *);
+
+// frame.c //////////////////////////////////////
+
+void layout_frame(struct ast *);
+
+// optimize.c ///////////////////////////////////
+
+void optimize(void);
+
+// inline.c /////////////////////////////////////
+
+void inline_calls(void);
+
+// loop.c ///////////////////////////////////////
+
+void unroll_loops(void);
+void vectorize_loops(void);
+void optimize_loops(void);
+
+// constprop.c //////////////////////////////////
+
+void propagate_constants(void);
+void eliminate_dead_stores(void);
+
+// cse.c ////////////////////////////////////////
+
+void eliminate_common_subexprs(void);
+
+// eval.c ///////////////////////////////////////
+
+void evaluate_pure_calls(void);
+
+// unused.c /////////////////////////////////////
+
+void remove_unused_symbols(void);
+
+// vm.c /////////////////////////////////////////
+
+int run_program(void);
+
+// profile.c ////////////////////////////////////
+
+enum {
+    PROF_ENTRY, // ノードに到達した回数
+    PROF_TAKEN, // if の then 側に進んだ回数、ループ本体を実行した回数
+};
+
+void assign_profile_ids(void);
+int profile_size(void);
+long profile_checksum(void);
+void read_profile(char *);
+long profile_count(struct ast *, int);
+bool is_cold(struct ast *);
+bool is_hot_call(struct ast *);
+int unlikely_branch(struct ast *);
+
+// regalloc.c ///////////////////////////////////
+
+void allocate_registers(struct ast *);
 
 // rehabcc.c ////////////////////////////////////
 
+// 入力ファイル
+extern char *filename;
+
 // 入力プログラム
 extern char *user_input;
 
@@ -201,18 +364,67 @@ extern struct ast *code[];
 // 文字列リテラル
 extern struct vector *string_literals;
 
+// コマンドラインオプション
+extern bool omit_frame_pointer; // 葉関数でフレームポインタを省略する
+extern bool promote_registers;  // アドレスを取られない変数をレジスタに置く
+extern bool inline_functions;   // 小さな関数を呼び出し元に展開する
+extern int inline_limit;        // 展開する関数の大きさの上限 (構文木のノード数)
+extern bool sibling_calls;      // return f(...) を call せずにジャンプで呼び出す
+extern bool loop_invariants;    // ループ不変式をループの外に出す
+extern bool ivopts;             // 誘導変数による添字計算をポインタの加算に置き換える
+extern bool ccp;                // ローカル変数の定数を伝播し、実行されない分岐を取り除く
+extern bool dse;                // 読み出されない変数への代入を取り除く
+extern bool cse;                // 基本ブロック内で同じ値の再計算を省く
+extern bool vectorize;          // 配列の要素ごとの演算を SIMD 命令でまとめて行う
+extern bool avx2;               // ベクトル化に AVX2 命令を使う
+extern bool unroll;             // ループを展開する
+extern int unroll_factor;       // 反復回数が定数でないループを何回分ずつ展開するか
+extern int unroll_limit;        // 展開後のループ本体の大きさの上限 (構文木のノード数)
+extern bool eval_pure_calls;    // 定数を引数とする副作用のない関数の呼び出しをコンパイル時に実行する
+extern int eval_limit;          // コンパイル時に実行する呼び出し 1 回あたりの評価ステップ数の上限
+extern bool whole_program;      // main から使われない関数やグローバル変数を出力しない
+extern struct vector *exported_symbols; // -fexport=name で指定した、外部から使われるシンボル
+extern char *profile_generate;  // 実行回数を計測し、終了時に書き出すファイル (-fprofile-generate)
+extern char *profile_use;       // 最適化に使う実行回数のファイル (-fprofile-use)
+extern bool debug_info;         // -g: 行番号のデバッグ情報を出力する
+extern bool run_bytecode;       // -run: アセンブリを出力せず、バイトコードに変換してその場で実行する
+extern bool streaming;          // -stream: 関数を 1 つずつ読んで出力し、その関数のトークンと構文木を解放する
+extern int lex_chunks;          // 入力を何個に分割してトークン分割するか。0 なら入力の大きさと CPU の数で決める (テスト用)
+extern char *scan_kernel;       // -fscan=: 字句解析で使う命令 (scalar, sse2, avx2)。NULL なら CPU に合わせて選ぶ (テスト用)
+
 // エラー処理
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 
+// scan.c ///////////////////////////////////////
+
+enum scan_kind {
+    SCAN_SPACE,  // 空白文字
+    SCAN_IDENT,  // 識別子に使える文字
+    SCAN_DIGIT,  // 数字
+    SCAN_STRING, // 文字列リテラルの中の、'"', '\\', 改行, '\0' 以外の文字
+};
+
+// skip_chars は入力の終端の '\0' より後ろもこのバイト数までは読む
+#define SCAN_PADDING 32
+
+void init_scan(void);
+char *skip_chars(char *, int);
+
 // tokenize.c ///////////////////////////////////
 
 void tokenize(void);
+void tokenize_lazily(void);
+bool lex_more(void);
 
 // parse.c //////////////////////////////////////
 
 void parse(void);
+struct ast *parse_next_function(void);
 
 // generate.c ///////////////////////////////////
 
 void generate(void);
+void gen_header(void);
+void gen_function(struct ast *);
+void gen_data(void);
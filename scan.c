@@ -0,0 +1,195 @@
+#include "rehabcc.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// 字句解析で、同じ種類の文字が続く範囲の終わりを探す
+// x86-64 では 16 バイト (SSE2) か 32 バイト (AVX2) ずつまとめて分類し、それ以外では 1 バイトずつ調べる
+// 入力の終端の '\0' より後ろも SCAN_PADDING バイトまでは読むので、入力の領域はその分だけ余分に確保しておく
+//
+//   SCAN_SPACE  空白文字 (' ', '\t', '\n', '\v', '\f', '\r')
+//   SCAN_IDENT  識別子に使える文字 (英数字と '_')
+//   SCAN_DIGIT  数字
+//   SCAN_STRING 文字列リテラルの中で特別な意味を持たない文字 ('"', '\\', '\n', '\0' 以外)
+
+static bool is_class(char c, int kind)
+{
+    switch (kind) {
+    case SCAN_SPACE:
+        return c == ' ' || ('\t' <= c && c <= '\r');
+    case SCAN_IDENT:
+        return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') || c == '_';
+    case SCAN_DIGIT:
+        return '0' <= c && c <= '9';
+    default:
+        return c != '"' && c != '\\' && c != '\n' && c != '\0';
+    }
+}
+
+static char *scalar_skip(char *p, int kind)
+{
+    while (is_class(*p, kind)) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef __x86_64__
+
+// 各バイトが [lo, hi] にあれば 0xff
+static inline __m128i sse2_in_range(__m128i x, char lo, char hi)
+{
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(hi - lo)), d);
+}
+
+static inline __m128i sse2_eq(__m128i x, char c)
+{
+    return _mm_cmpeq_epi8(x, _mm_set1_epi8(c));
+}
+
+// 各バイトが kind の文字なら 0xff
+static inline __m128i sse2_classify(__m128i x, int kind)
+{
+    switch (kind) {
+    case SCAN_SPACE:
+        return _mm_or_si128(sse2_eq(x, ' '), sse2_in_range(x, '\t', '\r'));
+    case SCAN_IDENT: {
+        __m128i alpha = sse2_in_range(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z');
+        return _mm_or_si128(_mm_or_si128(alpha, sse2_in_range(x, '0', '9')), sse2_eq(x, '_'));
+    }
+    case SCAN_DIGIT:
+        return sse2_in_range(x, '0', '9');
+    default: {
+        __m128i special = _mm_or_si128(_mm_or_si128(sse2_eq(x, '"'), sse2_eq(x, '\\')),
+                                       _mm_or_si128(sse2_eq(x, '\n'), sse2_eq(x, '\0')));
+        return _mm_xor_si128(special, _mm_set1_epi8(-1));
+    }
+    }
+}
+
+static inline __attribute__((always_inline)) char *sse2_scan(char *p, int kind)
+{
+    for (;; p += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)p);
+        unsigned mask = ~_mm_movemask_epi8(sse2_classify(x, kind)) & 0xffff;
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+static char *sse2_skip(char *p, int kind)
+{
+    switch (kind) {
+    case SCAN_SPACE:
+        return sse2_scan(p, SCAN_SPACE);
+    case SCAN_IDENT:
+        return sse2_scan(p, SCAN_IDENT);
+    case SCAN_DIGIT:
+        return sse2_scan(p, SCAN_DIGIT);
+    default:
+        return sse2_scan(p, SCAN_STRING);
+    }
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i avx2_in_range(__m256i x, char lo, char hi)
+{
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(hi - lo)), d);
+}
+
+static inline AVX2 __m256i avx2_eq(__m256i x, char c)
+{
+    return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(c));
+}
+
+static inline AVX2 __m256i avx2_classify(__m256i x, int kind)
+{
+    switch (kind) {
+    case SCAN_SPACE:
+        return _mm256_or_si256(avx2_eq(x, ' '), avx2_in_range(x, '\t', '\r'));
+    case SCAN_IDENT: {
+        __m256i alpha = avx2_in_range(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z');
+        return _mm256_or_si256(_mm256_or_si256(alpha, avx2_in_range(x, '0', '9')), avx2_eq(x, '_'));
+    }
+    case SCAN_DIGIT:
+        return avx2_in_range(x, '0', '9');
+    default: {
+        __m256i special = _mm256_or_si256(_mm256_or_si256(avx2_eq(x, '"'), avx2_eq(x, '\\')),
+                                          _mm256_or_si256(avx2_eq(x, '\n'), avx2_eq(x, '\0')));
+        return _mm256_xor_si256(special, _mm256_set1_epi8(-1));
+    }
+    }
+}
+
+static inline AVX2 __attribute__((always_inline)) char *avx2_scan(char *p, int kind)
+{
+    for (;; p += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)p);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(avx2_classify(x, kind));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+static AVX2 char *avx2_skip(char *p, int kind)
+{
+    switch (kind) {
+    case SCAN_SPACE:
+        return avx2_scan(p, SCAN_SPACE);
+    case SCAN_IDENT:
+        return avx2_scan(p, SCAN_IDENT);
+    case SCAN_DIGIT:
+        return avx2_scan(p, SCAN_DIGIT);
+    default:
+        return avx2_scan(p, SCAN_STRING);
+    }
+}
+
+#endif
+
+static char *(*skip_fn)(char *, int);
+
+// CPU が対応している命令で最も速いものを選ぶ
+// -fscan= で指定された場合はそれを使う
+void init_scan(void)
+{
+    skip_fn = scalar_skip;
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    skip_fn = has_avx2 ? avx2_skip : sse2_skip;
+#endif
+    if (!scan_kernel) {
+        return;
+    }
+    if (!strcmp(scan_kernel, "scalar")) {
+        skip_fn = scalar_skip;
+        return;
+    }
+#ifdef __x86_64__
+    if (!strcmp(scan_kernel, "sse2")) {
+        skip_fn = sse2_skip;
+        return;
+    }
+    if (!strcmp(scan_kernel, "avx2")) {
+        if (!has_avx2) {
+            error("この CPU は AVX2 命令に対応していません");
+        }
+        skip_fn = avx2_skip;
+        return;
+    }
+#endif
+    error("-fscan= に指定できない値です: %s", scan_kernel);
+}
+
+// p から kind の文字が続く範囲の次の位置を返す
+char *skip_chars(char *p, int kind)
+{
+    return skip_fn(p, kind);
+}
@@ -1,9 +1,14 @@
 #!/bin/bash
+# 引数に与えたオプションはすべてのテストでコンパイラに渡す
+global_flags="$*"
+
 try() {
     expected="$1"
     input="$2"
+    flags="$3"
 
-    ./rehabcc "$input" > tmp.s
+    echo "$input" > tmp.src
+    ./rehabcc $global_flags $flags tmp.src > tmp.s
     gcc -no-pie -o tmp tmp.s test/helper.o
     ./tmp
 
@@ -16,6 +21,67 @@ try() {
     fi
 }
 
+# -run でバイトコードに変換して、その場で実行する
+try_run() {
+    expected="$1"
+    input="$2"
+    flags="$3"
+
+    echo "$input" > tmp.src
+    ./rehabcc -run $global_flags $flags tmp.src
+
+    actual="$?"
+    if [ "$actual" = "$expected" ]; then
+        echo "$input => $actual"
+    else
+        echo "$input => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+# コンパイルしたプログラムでシンボルが置かれたセクションを nm の種類の文字で調べる (B なら .bss、D なら .data)
+try_symbol() {
+    expected="$1"
+    symbol="$2"
+    input="$3"
+    flags="$4"
+
+    echo "$input" > tmp.src
+    ./rehabcc $global_flags $flags tmp.src > tmp.s
+    gcc -no-pie -o tmp tmp.s test/helper.o
+
+    actual=$(nm tmp | awk -v s="$symbol" '$3 == s { print toupper($2) }')
+    if [ "$actual" = "$expected" ]; then
+        echo "$input ($symbol) => $actual"
+    else
+        echo "$input ($symbol) => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+# -fprofile-generate で実行回数を計測したプログラムを実行してから、
+# その結果を -fprofile-use で使って再びコンパイルして実行する
+try_pgo() {
+    expected="$1"
+    input="$2"
+    flags="$3"
+
+    echo "$input" > tmp.src
+    rm -f tmp.prof
+    for profile in -fprofile-generate=tmp.prof -fprofile-use=tmp.prof; do
+        ./rehabcc $global_flags $flags $profile tmp.src > tmp.s
+        gcc -no-pie -o tmp tmp.s test/helper.o
+        ./tmp
+
+        actual="$?"
+        if [ "$actual" != "$expected" ]; then
+            echo "$input ($profile) => $expected expected, but got $actual"
+            exit 1
+        fi
+    done
+    echo "$input => $actual"
+}
+
 try 0 'int main() { return 0; }'
 try 42 'int main() { return 42; }'
 try 21 'int main() { return 5+20-4; }'
@@ -80,8 +146,8 @@ try 3 'int identity(int n) { return n; } int main() { return identity(1) + ident
 try 5 'int fib(int n) { if (n <= 1) { return 1; } return fib(n-2) + fib(n-1); } int main() { return fib(4); }'
 
 # ステップ16
-try 42 'int main() { int x; int y; x = 42; y = &x; return *y; }'
-try 42 'int main() { int x; int y; int z; x = 3; y = 42; z = &x - 8; return *z; }'
+try 42 'int main() { int x; int *y; x = 42; y = &x; return *y; }'
+try 42 'int main() { int x; int y; int *z; x = 3; y = 42; z = &y; z = &x - 4; return *z; }'
 
 # ステップ18
 try 42 'int main() { int x; int *y; y = &x; *y = 42; return x; }'
@@ -110,5 +176,229 @@ try 3 'int main() { char x[3]; x[0] = -1; x[1] = 2; int y; y = 4; return x[0] +
 # ステップ25
 try 42 'int main() { printf("hello rehabcc!"); return 42; }'
 
+# スタックフレームの配置
+try 7 'int main() { char c; int x; char d; int *p; c = 1; x = 2; d = 3; p = &x; *p = *p + 1; return c + x + d; }'
+try 3 'int main() { char a[3]; int b; a[0] = 1; a[1] = 1; a[2] = 1; b = 0; return a[0] + a[1] + a[2] + b; }'
+try 6 'int main() { int x; x = 1; { int y; y = 2; x = x + y; } { int z; z = 3; x = x + z; } return x; }'
+try 5 'int main() { int x; x = 5; { int x; x = 7; } return x; }'
+try 10 'int sum(char a, int b, char c, int d) { return a + b + c + d; } int main() { return sum(1, 2, 3, 4); }'
+
+# 葉関数のフレームポインタ省略
+try 21 'int sq(int x) { int y; y = x * x; return y; } int main() { return sq(4) + sq(2) + 1; }'
+try 21 'int sq(int x) { int y; y = x * x; return y; } int main() { return sq(4) + sq(2) + 1; }' -fno-omit-frame-pointer
+try 45 'int main() { int a[40]; int i; for (i = 0; i < 10; i = i + 1) a[i] = i; return a[0] + a[1] + a[2] + a[3] + a[4] + a[5] + a[6] + a[7] + a[8] + a[9]; }'
+try 10 'int f(int a, int b, int c) { return a * (b + (c - (a - (b * c)))); } int main() { return f(1, 2, 3); }'
+try 6 'int add(int a, int b) { return a + b; } int main() { return add(1, add(2, 3)); }'
+
+# 型の大きさに合わせたメモリアクセス
+try 1 'int main() { int a[2]; a[0] = 1; a[1] = 5; return a[0] == 1; }'
+try 1 'int main() { int a[3]; a[0] = 1; a[1] = 2; a[2] = 3; a[1] = -1; return a[2] == 3; }'
+try 4 'int main() { int a[3]; int *p; a[0] = 1; a[1] = 2; a[2] = 3; p = a; *(p + 1) = 0; return a[0] + a[1] + a[2]; }'
+try 1 'int main() { char b[4]; b[0] = -1; b[1] = 7; return b[0] == -1; }'
+try 8 'int main() { char b[4]; char *p; b[0] = 1; b[1] = 2; b[2] = 3; b[3] = 4; p = b + 1; *p = 0; return b[0] + b[2] + b[3]; }'
+try 1 'int g[2]; int main() { g[0] = 3; g[1] = 9; return g[0] == 3; }'
+try 1 'int main() { int x; int y; x = 7; y = -1; return x == 7; }'
+
+# アドレスを取られない変数のレジスタ割り当て
+try 45 'int sum(int n) { int s; int i; s = 0; for (i = 0; i < n; i = i + 1) s = s + i; return s; } int main() { return sum(10); }'
+try 21 'int f(int a, int b, int c, int d, int e, int g) { return a + b + c + d + e + g; } int main() { return f(1, 2, 3, 4, 5, 6); }'
+try 21 'int id(int x) { return x; } int main() { int a; int b; int c; int d; int e; int g; a = 1; b = 2; c = 3; d = 4; e = 5; g = 6; return id(a) + id(b) + c + d + id(e) + g; }'
+try 1 'int f(char c) { return c == -1; } int main() { char c; c = 255; return f(c); }'
+try 3 'int main() { int x; int *p; x = 1; p = &x; *p = 3; return x; }'
+try 13 'int fib(int n) { if (n <= 1) return 1; return fib(n - 1) + fib(n - 2); } int main() { return fib(6); }'
+
+# 関数のインライン展開
+try 42 'int sq(int x) { return x * x; } int main() { return sq(6) + sq(2) + sq(1) + 1; }' -O2
+try 7 'int get(int *p, int i) { return p[i]; } int main() { int a[3]; a[0] = 5; a[1] = 7; a[2] = 9; return get(a, 1); }' -O2
+try 3 'int max(int a, int b) { if (a < b) return b; return a; } int main() { return max(1, 3) + max(0, 0); }' -O2
+try 9 'int f(int x) { { int y; y = x + 1; x = y; } { int z; z = x * 2; x = z; } return x; } int main() { int a; int b; { int c; c = 2; a = f(c) + c; } b = a + f(-1); return b + 1; }' -O2
+try 15 'int sq(int x) { return x * x; } int sum_sq(int a, int b) { return sq(a) + sq(b); } int main() { return sum_sq(sq(1), 2) + sum_sq(3, 0) + 1; }' -O2
+try 13 'int fib(int n) { if (n <= 1) return 1; return fib(n - 1) + fib(n - 2); } int main() { return fib(6); }' -O2
+try 5 'int g; int inc() { g = g + 1; return g; } int sub(int a, int b) { return a - b; } int main() { g = 0; return sub(inc() * 10, inc() + 3); }' -O2
+try 4 'int big(int x) { x = x + 1; x = x + 1; x = x + 1; x = x + 1; return x; } int main() { return big(0); }' '-O2 -finline-limit=5'
+
+# 末尾呼び出しと自己末尾再帰のループ化
+try 128 'int count(int n, int acc) { if (n == 0) return acc; return count(n - 1, acc + 1); } int main() { return count(10000000, 0); }' -O2
+try 0 'int even(int n) { if (n == 0) return 1; return odd(n - 1); } int odd(int n) { if (n == 0) return 0; return even(n - 1); } int main() { return even(1000001); }' -O2
+try 120 'int fact(int n, int acc) { if (n <= 1) return acc; return fact(n - 1, acc * n); } int main() { return fact(5, 1); }' -O2
+try 3 'int swap(int a, int b, int n) { if (n == 0) return a - b; return swap(b, a, n - 1); } int main() { return swap(5, 2, 4); }' -O2
+try 6 'int sum(int *p, int n, int acc) { if (n == 0) return acc; return sum(p + 1, n - 1, acc + *p); } int main() { int a[3]; a[0] = 1; a[1] = 2; a[2] = 3; return sum(a, 3, 0); }' -O2
+
+# ループ不変式の移動と誘導変数の強度低減
+try 94 'int main() { int a[10]; int b[10]; int i; int n; int s; n = 3; for (i = 0; i < 10; i = i + 1) { a[i] = i * n + 1; b[i] = a[i] * 2; } s = 0; i = 0; while (i < 10) { s = s + b[i] + n * 2; i = i + 1; } return s; }' -O2
+try 68 'int main() { int a[8]; int i; int s; for (i = 0; i < 8; i = i + 1) a[i] = i; s = 0; for (i = 7; i > 0; i = i - 2) s = s + a[i] * a[i - 1]; return s; }' -O2
+try 20 'int g; int bump() { g = g + 1; return 0; } int main() { int i; int s; g = 0; s = 0; for (i = 0; i < 5; i = i + 1) { s = s + g * 2; bump(); } return s; }' -O2
+try 30 'int main() { int i; int n; int x; int *p; n = 4; x = 0; p = &n; for (i = 0; i < 3; i = i + 1) { x = x + n * 2; *p = *p + 1; } return x; }' -O2
+try 7 'int main() { int a[5]; int i; int k; k = 0; for (i = 0; i < 0; i = i + 1) a[i] = 10 / k; return 7; }' -O2
+try 72 'int main() { char s[6]; int i; int n; for (i = 0; i < 5; i = i + 1) s[i] = 65 + i; s[5] = 0; n = 0; while (s[n] != 0) n = n + 1; return n + s[2]; }' -O2
+try 63 'int main() { int i; int n; int s; n = 3; s = 0; for (i = 0; i < 3; i = i + 1) { int *q; int x; q = &x; *q = 0; s = s + n * 7 + x; } return s; }' '-O2 -fno-promote-registers'
+try 24 'int main() { int a[4]; int i; int s; for (i = 0; i < 4; i = i + 1) a[i] = i; s = 0; for (i = 0; i < 4; i = i + 1) { int *q; int x; q = &x; *q = a[i] * 2; s = s + x + a[i] * 2; } return s; }' '-O2 -fno-promote-registers'
+
+# ループ展開
+try 22 'int main() { int a[4]; int i; int s; for (i = 0; i < 4; i = i + 1) a[i] = i * 3; s = 0; for (i = 0; i < 4; i = i + 1) s = s + a[i]; return s + i; }' -O2
+try 99 'int sum(int *a, int n) { int i; int s; s = 0; for (i = 0; i < n; i = i + 1) s = s + a[i]; return s; } int main() { int a[11]; int i; for (i = 0; i < 11; i = i + 1) a[i] = i; return sum(a, 11) + sum(a, 3) * 100 + sum(a, 0); }' -O2
+try 217 'int f(int n) { int i; int s; s = 0; for (i = n; 0 <= i; i = i - 1) s = s * 2 + i; return s + i; } int main() { return f(5) - 40; }' -O2
+try 61 'int f(int n) { int i; int s; s = 0; for (i = 1; i <= n; i = i + 2) s = s + i; return s + i; } int main() { return f(10) + f(7); }' -O2
+try 30 'int main() { int i; int s; s = 0; for (i = 0; i < 10; i = i + 1) { if (i == 4) i = i + 3; s = s + i; } return s; }' -O2
+try 106 'int g; int lim() { g = g + 1; return 5; } int main() { int i; int s; g = 0; s = 0; for (i = 0; i < lim(); i = i + 1) s = s + i; return s * 10 + g; }' -O2
+try 99 'int sum(int *a, int n) { int i; int s; s = 0; for (i = 0; i < n; i = i + 1) s = s + a[i]; return s; } int main() { int a[11]; int i; for (i = 0; i < 11; i = i + 1) a[i] = i; return sum(a, 11) + sum(a, 3) * 100 + sum(a, 0); }' '-O2 -funroll-factor=3'
+try 22 'int main() { int a[4]; int i; int s; for (i = 0; i < 4; i = i + 1) a[i] = i * 3; s = 0; for (i = 0; i < 4; i = i + 1) s = s + a[i]; return s + i; }' '-O2 -funroll-limit=10'
+try 189 'int f(int n) { int i; int m; int s; m = 3; s = 0; for (i = 0; i < n; i = i + 1) { int *q; int x; q = &x; *q = 0; s = s + m * 7 + x; } return s; } int main() { return f(9); }' '-O2 -fno-promote-registers'
+
+# ループのベクトル化
+try 190 'int main() { int a[10]; int b[10]; int c[10]; int i; int s; for (i = 0; i < 10; i = i + 1) { b[i] = i; c[i] = i * 3; } for (i = 0; i < 10; i = i + 1) a[i] = b[i] + c[i]; s = 0; for (i = 0; i < 10; i = i + 1) s = s + a[i]; return s + i; }' -O2
+try 137 'int sub(int *a, int *b, int *c, int n) { int i; for (i = 0; i <= n; i = i + 1) a[i] = b[i] - c[i]; return i; } int main() { int a[21]; int b[21]; int c[21]; int i; int s; for (i = 0; i < 21; i = i + 1) { b[i] = i * i; c[i] = i; } s = sub(a, b, c, 20); for (i = 0; i < 21; i = i + 1) s = s + a[i]; return s - 2800; }' -O2
+try 218 'int main() { char a[40]; char b[40]; int i; int k; int s; k = 100; for (i = 0; i < 40; i = i + 1) b[i] = i * 5; for (i = 0; i < 37; i = i + 1) a[i] = b[i] + k; s = 0; for (i = 0; i < 37; i = i + 1) s = s + a[i]; return s + 100; }' -O2
+try 20 'int main() { int a[20]; int *p; int i; for (i = 0; i < 20; i = i + 1) a[i] = 1; p = a + 1; for (i = 0; i < 19; i = i + 1) p[i] = a[i] + 1; return a[19]; }' -O2
+try 40 'int main() { int a[20]; int *p; int i; for (i = 0; i < 20; i = i + 1) a[i] = i; p = a + 1; for (i = 0; i < 19; i = i + 1) a[i] = p[i] * 1 + 0 - 0; for (i = 0; i < 19; i = i + 1) a[i] = p[i]; return a[0] + a[17] * 2; }' -O2
+try 143 'int main() { int a[13]; int b[13]; int i; int n; int s; n = 13; for (i = 0; i < n; i = i + 1) a[i] = 7 - n; for (i = 0; i < n; i = i + 1) b[i] = 5 - a[i]; s = 0; for (i = 0; i < n; i = i + 1) s = s + b[i]; return s; }' -O2
+try 137 'int sub(int *a, int *b, int *c, int n) { int i; for (i = 0; i <= n; i = i + 1) a[i] = b[i] - c[i]; return i; } int main() { int a[21]; int b[21]; int c[21]; int i; int s; for (i = 0; i < 21; i = i + 1) { b[i] = i * i; c[i] = i; } s = sub(a, b, c, 20); for (i = 0; i < 21; i = i + 1) s = s + a[i]; return s - 2800; }' '-O2 -mavx2'
+try 218 'int main() { char a[40]; char b[40]; int i; int k; int s; k = 100; for (i = 0; i < 40; i = i + 1) b[i] = i * 5; for (i = 0; i < 37; i = i + 1) a[i] = b[i] + k; s = 0; for (i = 0; i < 37; i = i + 1) s = s + a[i]; return s + 100; }' '-O2 -mavx2'
+try 20 'int main() { int a[20]; int *p; int i; for (i = 0; i < 20; i = i + 1) a[i] = 1; p = a + 1; for (i = 0; i < 19; i = i + 1) p[i] = a[i] + 1; return a[19]; }' '-O2 -mavx2'
+
+# 共通部分式の削除
+try 44 'int f(int x, int y) { return x * y + x * y; } int main() { return f(3, 4) + f(2, 5); }' -O2
+try 59 'int main() { int a[3]; int s; a[1] = 5; s = a[1] + a[1]; a[1] = 7; s = s + a[1] * a[1]; return s; }' -O2
+try 26 'int main() { int x; int *p; int s; x = 3; p = &x; s = x * 2; *p = 10; s = s + x * 2; return s; }' -O2
+try 85 'int g; int set() { g = 9; return 0; } int main() { int s; g = 2; s = g * g; set(); return s + g * g; }' -O2
+try 80 'int main() { int x; int y; int s; x = 4; y = 5; s = x * y; x = 6; s = s + x * y + y * x; return s; }' -O2
+try 39 'int main() { int a; int b; int c; int d; a = 3; b = 4; c = a * b + 1; d = a * b + 1; return c + d + (b * a + 1); }' -O2
+try 56 'int main() { char c; int x; x = 300; c = x + 0; return x + 0 - c - 200; }' -O2
+try 29 'int f(int x) { int s; s = x * x; if (x > 2) s = s + x * x; return s + x * x; } int main() { return f(3) + f(1); }' -O2
+try 132 'int main() { int a[8]; int i; int n; int s; n = 3; s = 0; for (i = 0; i < 8; i = i + 1) { int t; t = i * n + n * 2; a[i] = t; } for (i = 0; i < 8; i = i + 1) s = s + a[i]; return s; }' -O2
+try 130 'int f(int a, int b) { int r; { int x; x = a * b; r = x; } { int y; y = 100; r = r + a * b + y; } return r; } int main() { return f(3, 5); }' '-O1 -fcse -fno-ccp -fno-dse -fno-promote-registers'
+try 183 'int f(int a, int b) { int r; r = 0; { int p; int q; p = a * b; q = a + b * 2; r = r + p * q; } { int c; int d; int e; int s; c = a + b * 2; d = a * b; e = a; s = d; { int g; int h; g = r; h = a; { { r = r + a + b * 2; } } { r = r + h + c; } { int k; k = r; r = r + h + k; r = r + g + k; r = r + e * e; } } { int m; int n; m = a + b * 2; n = m + d; r = r + d * n; r = r + c - n; } } return r; } int main() { int x; int *p; p = &x; *p = 3; return f(*p, 5) / 7; }' -O2
+
+# 定数伝播と不要な分岐・代入の削除
+try 1 'int main() { int n; n = 10; if (n > 5) return 1; return 2; }'
+try 11 'int main() { int x; int s; int i; x = 1; s = 0; for (i = 0; i < 10; i = i + 1) { if (x != 1) x = 2; s = s + x; } return s + x; }'
+try 7 'int main() { int d; int s; d = 0; s = 7; while (d) { s = s + 1; } return s; }'
+try 3 'int main() { return 3; return 4; }'
+try 1 'int main() { char c; c = 200; if (c < 0) return 1; return 2; }'
+try 40 'int sq(int x) { return x * x; } int main() { return sq(6) + sq(2); }'
+try 30 'int f(int a) { int x; if (a) x = 1; else x = 2; return x * 10; } int main() { return f(0) + f(3); }'
+try 2 'int g; int bump() { g = g + 1; return g; } int main() { int x; g = 0; x = bump(); x = bump(); return g; }'
+try 5 'int main() { int z; z = 0; if (z) return 10 / z; return 5; }'
+try 10 'int main() { int i; int n; n = 0; for (i = 0; i < 5; i = i + 1) n = n + 2; return n; }'
+try 8 'int main() { int i; int s; s = 3; for (i = 5; i < 3; i = i + 1) s = s + 1; return s + i; }'
+try 24 'int f(int n) { int k; int s; k = 4; s = 0; while (n > 0) { s = s + k * 2; n = n - 1; } if (k == 4) return s; return 99; } int main() { return f(3); }'
+
+# 使われない関数とグローバル変数の削除
+try 3 'int g; int unused() { g = 1; return missing(); } int used(int x) { return x + 1; } int main() { return used(2); }' -fwhole-program
+try 7 'int b() { return missing(); } int main() { int x; x = 0; if (x) return b(); return 7; }' '-fwhole-program -fccp'
+try 5 'int g; int h; int unused() { return h; } int main() { g = 5; return g; }' -fwhole-program
+
+# 副作用のない関数呼び出しのコンパイル時実行
+try 65 'int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main() { return fib(20) - 6700; }'
+try 35 'int sum(int n) { int a[10]; int i; int s; for (i = 0; i < 10; i = i + 1) a[i] = i * n; s = 0; for (i = 0; i < 10; i = i + 1) s = s + a[i]; return s; } int main() { if (sum(2) != 90) return missing(); return sum(3) - 100; }' '-feval-pure-calls -fccp'
+try 54 'int c(int x) { char b; b = x; return b; } int main() { return c(300) + 10; }'
+try 41 'int set(int *p, int v) { *p = v; return 0; } int f(int n) { int x; set(&x, n * 2); return x + 1; } int main() { return f(20); }'
+try 4 'int g; int f(int x) { g = x; return x; } int main() { f(4); return g; }'
+try 3 'int f() { for (;;) {} return 1; } int main() { int x; x = 0; if (x) return f(); return 3; }'
+try 200 'int loop(int n) { int i; int s; s = 0; for (i = 0; i < n; i = i + 1) s = s + 1; return s; } int main() { return loop(200); }' '-feval-limit=500'
+try 7 'int sq(int x) { return x * x; } int f(int n) { int s; s = 0; while (n > 0) { s = s + sq(n); n = n - 1; } return s; } int main() { return f(f(2) - 2) - 7; }'
+
+# バイトコードでの実行
+try_run 42 'int main() { printf("hello rehabcc!\n"); return 42; }'
+try_run 5 'int main() { return printf("%d %d\n", 12, 3); }'
+try_run 3 'int main() { int *p; p = alloc4(1, 2, 3, 4); int *q; q = p + 2; return *q; }'
+try_run 25 'int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main() { return fib(25) - 75000; }'
+try_run 12 'int g; int main() { char x[3]; x[0] = -1; x[1] = 2; int y; y = 4; g = 9; return x[0] + y + g; }'
+try_run 7 'int main() { char c; int x; char d; int *p; c = 1; x = 2; d = 3; p = &x; *p = *p + 1; return c + x + d; }'
+try_run 54 'int main() { char c; int x; x = 300; c = x; return c + 10; }'
+try_run 14 'int main() { int x; int y; x = 4; y = x + (x = 5); return y + x; }'
+try_run 10 'int sum(char a, int b, char c, int d) { return a + b + c + d; } int main() { return sum(1, 2, 3, 4); }'
+try_run 128 'int count(int n, int acc) { if (n == 0) return acc; return count(n - 1, acc + 1); } int main() { return count(10000000, 0); }' -O2
+try_run 45 'int main() { int a[10]; int i; int s; for (i = 0; i < 10; i = i + 1) a[i] = i; s = 0; for (i = 0; i < 10; i = i + 1) s = s + a[i]; return s; }' -O2
+
+# プロファイルによる最適化
+try_pgo 166 'int g; int f(int x) { if (x == 999) { g = g + 100; return 1; } return x * 2; } int main() { int i; int s; s = 0; for (i = 0; i < 1000; i = i + 1) { if (i == 500) s = s + 3; else s = s + f(i); } return s; }' -O2
+try_pgo 100 'int main() { int i; int s; s = 0; for (i = 0; i < 100; i = i + 1) { if (i < 95) s = s + 1; else s = s + 1; } return s; }'
+try_pgo 28 'int big(int x) { int s; s = x; s = s * 3 + x * 2 - 1; s = s * 3 + x * 2 - 1; s = s * 3 + x * 2 - 1; s = s / 9; return s; } int cold(int x) { return big(x) + 1; } int main() { int i; int s; s = 0; for (i = 0; i < 50; i = i + 1) s = big(i); if (s == 0) return cold(1); return s / 10; }' -O2
+try_pgo 3 'int f(int n) { int i; int s; s = 0; for (i = 0; i < n; i = i + 1) s = s + 1; return s; } int main() { return f(1) + f(2); }' -O2
+try 10 'int main() { int i; int s; s = 0; for (i = 0; i < 5; i = i + 1) s = s + i; return s; }' '-fprofile-generate=tmp"q\.prof'
+
+# 行番号とアンワインド情報
+try 42 'int main() { printf("hello rehabcc!"); return 42; }' -g
+try 14 'int leaf(int *p, int x) { int a[40]; a[0] = x; return a[0] + (x * 2 + *p); } int mid(int n) { int s; s = leaf(&n, n); return s + 2; } int main() { return mid(3); }' -g
+try 55 'int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main() { int i; i = 10; return fib(i); }' '-g -O2'
+try_pgo 100 'int main() { int i; int s; s = 0; for (i = 0; i < 100; i = i + 1) { if (i < 95) s = s + 1; else s = s + 1; } return s; }' -g
+
+# 文字列リテラルのエスケープシーケンスとまとめての配置
+try 10 'int main() { char *s; s = "\n"; return s[0]; }'
+try 65 'int main() { char *s; s = "\101"; return s[0]; }'
+try 66 'int main() { char *s; s = "\x42"; return s[0]; }'
+try 98 'int main() { char *s; s = "a\"b"; return s[2]; }'
+try 92 'int main() { char *s; s = "\\"; return s[0]; }'
+try 216 'int main() { char *p; char *q; p = "lo"; q = "hello"; return p[0] + q[3]; }'
+try 1 'int main() { char *p; char *q; p = "same"; q = "same"; return p == q; }'
+try 0 'int main() { char *s; s = "ab\0cd"; return s[2]; }'
+try 99 $'int main() { char *s; s = "ab\\\ncd"; return s[2]; }'
+try 5 $'char a[] = "ab\\\ncd"; int main() { return sizeof(a); }'
+try_run 216 'int main() { char *p; char *q; p = "lo\n"; q = "hello\n"; printf(q); return p[0] + q[3]; }'
+
+# グローバル変数の初期値
+try 3 'int a = 3; int main() { return a; }'
+try 44 'char c = 300; int main() { return c; }'
+try 14 'int a = 2 * 3 + 8; int main() { return a; }'
+try 6 'int b[5] = {1, 2, 3,}; int main() { return b[0] + b[1] + b[2] + b[3] + b[4]; }'
+try 12 'int b[] = {4, 4, 4}; int main() { return b[0] + b[1] + b[2] + sizeof(b) - 12; }'
+try 111 'char s[] = "hello"; int main() { return s[4] + sizeof(s) - 6; }'
+try 0 'char t[8] = "hi"; int main() { return t[2] + t[7]; }'
+try 114 'char *p = "world"; int main() { return p[2]; }'
+try 7 'int a = 7; int *q = &a; int main() { return *q; }'
+try 30 'int b[4] = {10, 20, 30, 40}; int *r = b + 2; int main() { return *r; }'
+try 20 'int b[4] = {10, 20, 30, 40}; int *r = &b[1]; int main() { return *r; }'
+try 5 'int a = 5; int *q = &a; int **qq = &q; int main() { return **qq; }'
+try 0 'int z; int big[100]; int main() { return z + big[99]; }'
+try 9 'int a = 4; int f() { a = a + 5; return a; } int main() { return f(); }' -O2
+try_run 115 'int a = 7; int *q = &a; char *p = "world"; int b[] = {1, 2}; int main() { printf(p); return *q + p[1] + b[1] - 5; }'
+try 3 'int a = 3; int *q = &a; int main() { return *q; }' -fwhole-program
+try_symbol B big 'int big[100000] = {0}; int main() { return big[99999]; }'
+try_symbol B x 'int x = 0; int main() { return x; }'
+try_symbol B c 'char c[4] = ""; int main() { return c[0]; }'
+try_symbol D y 'int y[3] = {0, 0, 1}; int main() { return y[2]; }'
+try_symbol D p 'int a; int *p = &a; int main() { return *p; }'
+
+# 字句解析で 16/32 バイトずつ調べる範囲の境界 (make test では -fscan= で命令を変えても実行する)
+# 識別子、数、空白、文字列の中身が境界の前後で終わる場合と、エスケープや " が境界の前後に来る場合
+try 91 'int main() { int abcdefghijklmno; int abcdefghijklmnop; int abcdefghijklmnopq; int abcdefghijklmnopqrstuvwxyzABCDE; int abcdefghijklmnopqrstuvwxyzABCDEF; int abcdefghijklmnopqrstuvwxyzABCDEFG; abcdefghijklmno = 1; abcdefghijklmnop = 2; abcdefghijklmnopq = 3; abcdefghijklmnopqrstuvwxyzABCDE = 4; abcdefghijklmnopqrstuvwxyzABCDEF = 5; abcdefghijklmnopqrstuvwxyzABCDEFG = 6; return abcdefghijklmno * 1 + abcdefghijklmnop * 2 + abcdefghijklmnopq * 3 + abcdefghijklmnopqrstuvwxyzABCDE * 4 + abcdefghijklmnopqrstuvwxyzABCDEF * 5 + abcdefghijklmnopqrstuvwxyzABCDEFG * 6; }'
+try 21 'int main() { return 000000000000001 + 0000000000000002 + 00000000000000003 + 0000000000000000000000000000004 + 00000000000000000000000000000005 + 000000000000000000000000000000006; }'
+try 7 $'int main() { \t\n  \t\n  \t\n  \t\n int \t\n  \t\n  \t\n  \t\nx; \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n x \t\n  \t\n  \t\n  \t\n  = \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n7; \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  return \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n x; \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n } \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n  \t\n '
+try 36 'int main() { char *s0; char *s1; char *s2; char *s3; char *s4; char *s5; char *s6; char *s7; char *s8; char *s9; char *s10; char *s11; s0 = "aaaaaaaaaaaaaa\"bbbbbbbbbbbbbbb\\c"; s1 = "dddddddddddddd"; s2 = "aaaaaaaaaaaaaaa\"bbbbbbbbbbbbbbbb\\c"; s3 = "ddddddddddddddd"; s4 = "aaaaaaaaaaaaaaaa\"bbbbbbbbbbbbbbb\\c"; s5 = "dddddddddddddddd"; s6 = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\"bbbbbbbbbbbbbbbb\\c"; s7 = "dddddddddddddddddddddddddddddd"; s8 = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\"bbbbbbbbbbbbbbb\\c"; s9 = "ddddddddddddddddddddddddddddddd"; s10 = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\"bbbbbbbbbbbbbbbb\\c"; s11 = "dddddddddddddddddddddddddddddddd"; return (s0[14] == 34) + (s0[30] == 92) + (s0[31] == 99) + (s0[32] == 0) + (s1[13] == 100) + (s1[14] == 0) + (s2[15] == 34) + (s2[32] == 92) + (s2[33] == 99) + (s2[34] == 0) + (s3[14] == 100) + (s3[15] == 0) + (s4[16] == 34) + (s4[32] == 92) + (s4[33] == 99) + (s4[34] == 0) + (s5[15] == 100) + (s5[16] == 0) + (s6[30] == 34) + (s6[47] == 92) + (s6[48] == 99) + (s6[49] == 0) + (s7[29] == 100) + (s7[30] == 0) + (s8[31] == 34) + (s8[47] == 92) + (s8[48] == 99) + (s8[49] == 0) + (s9[30] == 100) + (s9[31] == 0) + (s10[32] == 34) + (s10[49] == 92) + (s10[50] == 99) + (s10[51] == 0) + (s11[31] == 100) + (s11[32] == 0); }'
+
+# 入力を分割してトークン分割する (-flex-chunks= で区間の数を固定して、区間の境界を色々な位置に置く)
+lex_src='int main() {
+    char *s;
+    char *t;
+    s = "ab\
+cd\"e\\f";
+    t = "\
+\
+x\n\
+y";
+    return s[4] + s[6] + t[0] + t[1] + t[2] + t[3] - s[2] - s[8] - 200;
+}'
+try 78 "$lex_src" -flex-chunks=2
+try 78 "$lex_src" -flex-chunks=3
+try 78 "$lex_src" -flex-chunks=5
+try 78 "$lex_src" -flex-chunks=8
+try 78 "$lex_src" -flex-chunks=100
+try 3 $'\nint main() { return 3; }' -flex-chunks=64
+
+# 関数を 1 つずつ出力する
+try 55 'int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main() { return fib(10); }' -stream
+try 21 'int g = 3; int a[3]; int set(int i, int v) { a[i] = v; return 0; } char *s = "hi"; int main() { set(1, 8); return g + a[1] + s[0] - 94; }' -stream
+try 104 'int f() { char *p; p = "hello"; return p[0]; } int h() { char *q; q = "lo"; return q[0]; } int main() { return f() + h() - 108; }' '-stream -O2'
+try 3 'int main() { int x; x = 1; return x + 2; } int after = 5;' '-stream -O2'
+
+# 二項演算子の優先順位と結合規則
+try 4 'int main() { return 10 - 3 - 3; }'
+try 2 'int main() { return 24 / 4 / 3; }'
+try 1 'int main() { return 2 + 3 * 4 > 10 == 1; }'
+try 1 'int main() { return 1 < 2 == 3 > 2; }'
+try 12 'int main() { int a; int b; a = b = 6 + 1 * 2 - 1; return a + b - 1 - 1; }'
+try 4 'int main() { int a[3]; int *p; p = a; *(p + 1) = 4; return a[1]; }'
+
 echo OK
-rm -f tmp tmp.s
+rm -f tmp tmp.s tmp.src tmp.prof 'tmp"q\.prof'
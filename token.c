@@ -1,46 +1,195 @@
 #include "rehabcc.h"
 
-static struct token *token = NULL;
+// 入力全体のトークン列。添字 0 は「トークンなし」を表すので、先頭のトークンは 1 番になる
+static struct token_array tokens = {NULL, NULL, NULL, NULL, 1, 0, NULL, 0, 0};
 
-struct token *new_token(enum token_kind kind, struct token *cur, char *str, int len)
+// 各行の先頭の、入力の先頭からの位置 (行番号を求めるときに作る)
+static int *line_starts;
+static int nlines;
+
+// 現在着目しているトークン
+static int token;
+
+static void reserve_tokens(struct token_array *a, int size)
+{
+    if (a->capacity >= size) {
+        return;
+    }
+    while (a->capacity < size) {
+        a->capacity = a->capacity ? a->capacity * 2 : 1024;
+    }
+    a->kind = realloc(a->kind, a->capacity * sizeof(unsigned char));
+    a->pos = realloc(a->pos, a->capacity * sizeof(int));
+    a->len = realloc(a->len, a->capacity * sizeof(int));
+    a->val = realloc(a->val, a->capacity * sizeof(int));
+}
+
+// トークン列の末尾に追加して、その添字を返す
+int add_token(struct token_array *a, enum token_kind kind, char *str, int len)
 {
-    struct token *tok = calloc(1, sizeof(struct token));
-    tok->kind = kind;
-    tok->str = str;
-    tok->len = len;
-    cur->next = tok;
+    reserve_tokens(a, a->size + 1);
+    int tok = a->size++;
+    a->kind[tok] = kind;
+    a->pos[tok] = str - user_input;
+    a->len[tok] = len;
+    a->val[tok] = 0;
     return tok;
 }
 
-struct token *get_token(void)
+// 文字列トークン tok の値を設定する
+// 複数のスレッドで別々のトークン列を作れるように、共有のアリーナではなく realloc で広げる
+void set_token_string(struct token_array *a, int tok, char *string)
+{
+    if (a->nstrings >= a->strings_capacity) {
+        a->strings_capacity = a->strings_capacity ? a->strings_capacity * 2 : 64;
+        a->strings = realloc(a->strings, a->strings_capacity * sizeof(char *));
+    }
+    a->val[tok] = a->nstrings;
+    a->strings[a->nstrings++] = string;
+}
+
+// 入力全体のトークン列の末尾に a をつなげる
+void append_tokens(struct token_array *a)
+{
+    if (a->size == 0) {
+        // トークンのない区間は配列も確保されていない
+        return;
+    }
+    int base = tokens.size;
+    reserve_tokens(&tokens, base + a->size);
+    memcpy(tokens.kind + base, a->kind, a->size * sizeof(unsigned char));
+    memcpy(tokens.pos + base, a->pos, a->size * sizeof(int));
+    memcpy(tokens.len + base, a->len, a->size * sizeof(int));
+    memcpy(tokens.val + base, a->val, a->size * sizeof(int));
+    tokens.size += a->size;
+
+    // 文字列トークンの値はトークンの順に並んでいるので、そのまま末尾に移す
+    for (int i = base; i < tokens.size; i++) {
+        if (tokens.kind[i] == TK_STRING) {
+            set_token_string(&tokens, i, a->strings[tokens.val[i]]);
+        }
+    }
+}
+
+char *token_str(int tok)
+{
+    return user_input + tokens.pos[tok];
+}
+
+int token_len(int tok)
+{
+    return tokens.len[tok];
+}
+
+int token_val(int tok)
 {
+    return tokens.val[tok];
+}
+
+char *token_string(int tok)
+{
+    return tokens.strings[tokens.val[tok]];
+}
+
+int token_line(int tok)
+{
+    if (!line_starts) {
+        int n = 1;
+        for (char *p = user_input; *p; p++) {
+            n += *p == '\n';
+        }
+        line_starts = calloc(n, sizeof(int));
+        nlines = 1;
+        for (char *p = user_input; *p; p++) {
+            if (*p == '\n') {
+                line_starts[nlines++] = p + 1 - user_input;
+            }
+        }
+    }
+    // pos 以下で最も後ろにある行の先頭を二分探索する
+    int pos = tokens.pos[tok];
+    int lo = 0, hi = nlines;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (line_starts[mid] <= pos) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo + 1;
+}
+
+// 少しずつトークン分割している場合は、着目しているトークンまで分割する
+static void fill_tokens(void)
+{
+    while (token >= tokens.size && lex_more()) {
+    }
+}
+
+// 着目しているトークンより前のトークンを捨てて、着目しているトークンを 1 番にする
+// 捨てたトークンの番号はその後使えない
+// 残りのトークンの方が多いうちは、移す量が捨てる量を超えないように何もしない
+void discard_tokens(void)
+{
+    int n = tokens.size - token;
+    if (n > token - 1) {
+        return;
+    }
+    memmove(tokens.kind + 1, tokens.kind + token, n * sizeof(unsigned char));
+    memmove(tokens.pos + 1, tokens.pos + token, n * sizeof(int));
+    memmove(tokens.len + 1, tokens.len + token, n * sizeof(int));
+    memmove(tokens.val + 1, tokens.val + token, n * sizeof(int));
+    tokens.size = n + 1;
+    token = 1;
+
+    // 残ったトークンの文字列だけを前に詰める
+    int nstrings = 0;
+    for (int i = 1; i < tokens.size; i++) {
+        if (tokens.kind[i] == TK_STRING) {
+            tokens.strings[nstrings] = tokens.strings[tokens.val[i]];
+            tokens.val[i] = nstrings++;
+        }
+    }
+    tokens.nstrings = nstrings;
+}
+
+int get_token(void)
+{
+    fill_tokens();
     return token;
 }
 
-void set_token(struct token *t)
+void set_token(int t)
 {
     token = t;
 }
 
-struct token *consume_token(enum token_kind kind)
+// 着目しているトークンの種類を返す。読み進めはしない
+enum token_kind peek_token(void)
+{
+    fill_tokens();
+    return tokens.kind[token];
+}
+
+int consume_token(enum token_kind kind)
 {
-    if (token->kind == kind) {
-        struct token *t = token;
-        token = token->next;
-        return t;
+    fill_tokens();
+    if (tokens.kind[token] == kind) {
+        return token++;
     }
-    return NULL;
+    return 0;
 }
 
-struct token *expect_token(enum token_kind kind)
+int expect_token(enum token_kind kind)
 {
-    if (token->kind == kind) {
-        struct token *t = token;
-        token = token->next;
-        return t;
+    fill_tokens();
+    if (tokens.kind[token] == kind) {
+        return token++;
     }
     else {
-        error_at(token->str, "%d ではありません", kind);
+        error_at(token_str(token), "%d ではありません", kind);
     }
 }
 
@@ -49,7 +198,8 @@ void error_token(char *fmt, ...)
     va_list ap;
     va_start(ap, fmt);
 
-    int pos = token->str - user_input;
+    fill_tokens();
+    int pos = tokens.pos[token];
     fprintf(stderr, "%s\n", user_input);
     fprintf(stderr, "%*s", pos, ""); // pos個の空白を出力
     fprintf(stderr, "^ ");
@@ -58,16 +208,17 @@ void error_token(char *fmt, ...)
     exit(1);
 }
 
-char *copy_token_str(struct token *tok)
+char *copy_token_str(int tok)
 {
-    char *str = calloc(tok->len + 1, sizeof(char));
-    strncpy(str, tok->str, tok->len);
+    char *str = arena_alloc(token_len(tok) + 1);
+    strncpy(str, token_str(tok), token_len(tok));
     return str;
 }
 
 void debug_print_token(void)
 {
+    fill_tokens();
     char *str = copy_token_str(token);
-    fprintf(stderr, "token = %d\n", token->kind);
+    fprintf(stderr, "token = %d\n", tokens.kind[token]);
     fprintf(stderr, "str = %s\n", str);
 }
@@ -1,4 +1,7 @@
 #include "rehabcc.h"
+#include <pthread.h>
+#include <setjmp.h>
+#include <unistd.h>
 
 struct token_kind_str {
     enum token_kind kind;
@@ -45,25 +48,119 @@ static struct token_kind_str keywords[] = {
 };
 // clang-format on
 
-// 識別子として受け入れる文字かどうかをチェックする
-static bool isident(char c)
+// 並行にトークン分割する入力の区間
+struct chunk {
+    char *start;
+    char *end;
+    struct token_array tokens;
+    jmp_buf error_jmp;
+    char *error_pos; // エラーがあればその位置とメッセージ
+    char *error_msg;
+};
+
+// 入力がこの大きさに満たなければ分割しない
+#define LEX_CHUNK_MIN (256 * 1024)
+
+// このスレッドがトークン分割している区間
+static _Thread_local struct chunk *current_chunk;
+
+// 他のスレッドの結果を待ってから入力の前の方のエラーを報告するため、ここではエラーを記録して区間の処理をやめる
+static void lex_error(char *pos, char *msg)
 {
-    return isalnum(c) || c == '_';
+    current_chunk->error_pos = pos;
+    current_chunk->error_msg = msg;
+    longjmp(current_chunk->error_jmp, 1);
 }
 
-// 入力文字列をトークン分割して最初のトークンを返す
-void tokenize(void)
+// エスケープシーケンスを読んで、その文字を返す
+static char read_escaped_char(char **pos)
 {
-    struct token head;
-    head.next = NULL;
-    struct token *cur = &head;
-    char *p = user_input;
+    char *p = *pos;
+    if ('0' <= *p && *p <= '7') {
+        // 8 進数は 3 桁まで
+        int c = 0;
+        for (int i = 0; i < 3 && '0' <= *p && *p <= '7'; i++) {
+            c = c * 8 + (*p++ - '0');
+        }
+        *pos = p;
+        return c;
+    }
+    if (*p == 'x') {
+        p++;
+        if (!isxdigit(*p)) {
+            lex_error(p, "不正な 16 進数のエスケープシーケンスです");
+        }
+        int c = 0;
+        for (; isxdigit(*p); p++) {
+            c = c * 16 + (isdigit(*p) ? *p - '0' : tolower(*p) - 'a' + 10);
+        }
+        *pos = p;
+        return c;
+    }
+
+    *pos = p + 1;
+    switch (*p) {
+    case 'a':
+        return '\a';
+    case 'b':
+        return '\b';
+    case 't':
+        return '\t';
+    case 'n':
+        return '\n';
+    case 'v':
+        return '\v';
+    case 'f':
+        return '\f';
+    case 'r':
+        return '\r';
+    case 'e':
+        return 27;
+    default:
+        return *p;
+    }
+}
+
+// 文字列リテラルの " と " の間 [start, end) を、エスケープシーケンスを解釈した文字列にする
+// \ と改行の組は行の継続なので取り除く
+// \0 を含む場合は、その手前までを文字列の内容とする
+static char *read_string(char *start, char *end)
+{
+    char *buf = calloc(end - start + 1, sizeof(char));
+    int len = 0;
+    for (char *p = start; p < end;) {
+        if (*p == '\\' && p[1] == '\n') {
+            p += 2;
+        }
+        else if (*p == '\\') {
+            p++;
+            buf[len++] = read_escaped_char(&p);
+        }
+        else {
+            buf[len++] = *p++;
+        }
+    }
+    return buf;
+}
+
+// [start, end) をトークン分割して chunk->tokens に入れる
+// end は改行の直後か入力の終わりで、トークンはそこをまたがない
+static void lex_chunk(struct chunk *chunk)
+{
+    struct token_array *a = &chunk->tokens;
+    char *p = chunk->start;
+    if (setjmp(chunk->error_jmp)) {
+        current_chunk = NULL;
+        return;
+    }
+    current_chunk = chunk;
 
 loop:
-    while (*p) {
+    while (p < chunk->end) {
         // 空白文字をスキップ
-        if (isspace(*p)) {
-            p++;
+        char *q = skip_chars(p, SCAN_SPACE);
+        if (q != p) {
+            p = q;
             continue;
         }
 
@@ -71,17 +168,7 @@ loop:
         for (int i = 0; symbols[i].kind != TK_EOF; i++) {
             int len = strlen(symbols[i].str);
             if (strncmp(p, symbols[i].str, len) == 0) {
-                cur = new_token(symbols[i].kind, cur, p, len);
-                p += len;
-                goto loop;
-            }
-        }
-
-        // キーワードのトークン化
-        for (int i = 0; keywords[i].kind != TK_EOF; i++) {
-            int len = strlen(keywords[i].str);
-            if (strncmp(p, keywords[i].str, len) == 0 && !isident(p[len])) {
-                cur = new_token(keywords[i].kind, cur, p, len);
+                add_token(a, symbols[i].kind, p, len);
                 p += len;
                 goto loop;
             }
@@ -89,19 +176,29 @@ loop:
 
         // 整数トークン
         if (isdigit(*p)) {
-            cur = new_token(TK_NUM, cur, p, 0);
-            cur->val = strtol(p, &p, 10); // 10桁まで
+            q = skip_chars(p, SCAN_DIGIT);
+            unsigned long val = 0;
+            for (char *d = p; d < q; d++) {
+                val = val * 10 + (*d - '0');
+            }
+            int tok = add_token(a, TK_NUM, p, 0);
+            a->val[tok] = val;
+            p = q;
             continue;
         }
 
-        // 識別子トークン
-        if (isident(*p)) {
-            char *q = p;
-            while (isident(*q)) {
-                q++;
-            }
+        // 識別子とキーワードのトークン化
+        q = skip_chars(p, SCAN_IDENT);
+        if (q != p) {
             int len = q - p;
-            cur = new_token(TK_IDENT, cur, p, len);
+            enum token_kind kind = TK_IDENT;
+            for (int i = 0; keywords[i].kind != TK_EOF; i++) {
+                if (strlen(keywords[i].str) == len && !memcmp(p, keywords[i].str, len)) {
+                    kind = keywords[i].kind;
+                    break;
+                }
+            }
+            add_token(a, kind, p, len);
             p = q;
             continue;
         }
@@ -109,21 +206,154 @@ loop:
         // 文字列リテラル
         if (*p == '"') {
             char *new_p = p + 1;
-            while (*new_p != '"') {
-                new_p++;
+            for (;;) {
+                new_p = skip_chars(new_p, SCAN_STRING);
+                if (*new_p == '"') {
+                    break;
+                }
+                if (*new_p == '\\' && new_p[1]) {
+                    new_p += 2;
+                    continue;
+                }
+                lex_error(p, "文字列リテラルが閉じられていません");
             }
             new_p++;
             int len = new_p - p;
-            cur = new_token(TK_STRING, cur, p, len);
-            cur->string = calloc(len - 1, sizeof(char));
-            memcpy(cur->string, p + 1, len - 2);
+            int tok = add_token(a, TK_STRING, p, len);
+            set_token_string(a, tok, read_string(p + 1, new_p - 1));
             p = new_p;
             continue;
         }
 
-        error_at(p, "トークン分割できません");
+        lex_error(p, "トークン分割できません");
+    }
+
+    current_chunk = NULL;
+}
+
+// 区間のトークンを入力全体のトークン列につなげて、区間のトークン列を解放する
+static void flush_chunk(struct chunk *chunk)
+{
+    struct token_array *a = &chunk->tokens;
+    append_tokens(a);
+    free(a->kind);
+    free(a->pos);
+    free(a->len);
+    free(a->val);
+    free(a->strings);
+}
+
+static void *lex_worker(void *arg)
+{
+    lex_chunk(arg);
+    return NULL;
+}
+
+// 入力を改行の直後で区切る
+// 文字列リテラルの中の改行は \ に続くものだけなので、直前が \ でない改行は文字列リテラルの外にある
+// (閉じられていない文字列リテラルの中にある場合も、どちらの分割でも同じ位置でエラーになる)
+static char *find_boundary(char *p)
+{
+    for (; *p; p++) {
+        if (*p == '\n' && (p == user_input || p[-1] != '\\')) {
+            return p + 1;
+        }
+    }
+    return p;
+}
+
+// 入力文字列をトークン分割して、最初のトークンに着目する
+// 大きな入力は分割して、複数のスレッドで並行にトークン分割してから順につなげる
+void tokenize(void)
+{
+    init_scan();
+
+    int len = strlen(user_input);
+    int nchunks = lex_chunks;
+    if (nchunks <= 0) {
+        nchunks = len / LEX_CHUNK_MIN;
+        int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nchunks > ncpus) {
+            nchunks = ncpus;
+        }
+        if (nchunks < 1) {
+            nchunks = 1;
+        }
+    }
+
+    struct chunk *chunks = calloc(nchunks, sizeof(struct chunk));
+    char *p = user_input;
+    for (int i = 0; i < nchunks; i++) {
+        chunks[i].start = p;
+        p = i == nchunks - 1 ? user_input + len : find_boundary(user_input + (long)len * (i + 1) / nchunks);
+        if (p < chunks[i].start) {
+            p = chunks[i].start;
+        }
+        chunks[i].end = p;
+    }
+
+    pthread_t *threads = calloc(nchunks, sizeof(pthread_t));
+    for (int i = 1; i < nchunks; i++) {
+        if (pthread_create(&threads[i], NULL, lex_worker, &chunks[i])) {
+            error("スレッドを作成できません");
+        }
+    }
+    lex_chunk(&chunks[0]);
+    for (int i = 1; i < nchunks; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // 入力の前の方にあるエラーを報告する
+    for (int i = 0; i < nchunks; i++) {
+        if (chunks[i].error_pos) {
+            error_at(chunks[i].error_pos, "%s", chunks[i].error_msg);
+        }
+    }
+
+    add_token(&chunks[nchunks - 1].tokens, TK_EOF, user_input + len, 0);
+    for (int i = 0; i < nchunks; i++) {
+        flush_chunk(&chunks[i]);
     }
+    set_token(1);
+}
 
-    new_token(TK_EOF, cur, p, 0);
-    set_token(head.next);
+// 少しずつトークン分割する場合の、まだ分割していない入力の先頭と入力の終わり
+static char *lex_pos;
+static char *lex_end;
+
+// 少しずつトークン分割する場合に、一度に分割する入力の大きさ
+#define LEX_STREAM_CHUNK (64 * 1024)
+
+// 入力をまだトークン分割せず、構文解析で必要になったときに lex_more で少しずつ分割する
+void tokenize_lazily(void)
+{
+    init_scan();
+    lex_pos = user_input;
+    lex_end = user_input + strlen(user_input);
+    set_token(1);
+}
+
+// 入力の続きをトークン分割してトークン列の末尾につなげる。入力の終わりまで分割済みなら false
+bool lex_more(void)
+{
+    if (!lex_pos) {
+        return false;
+    }
+    struct chunk *chunk = calloc(1, sizeof(struct chunk));
+    chunk->start = lex_pos;
+    chunk->end = lex_end - lex_pos > LEX_STREAM_CHUNK ? find_boundary(lex_pos + LEX_STREAM_CHUNK) : lex_end;
+    lex_chunk(chunk);
+    if (chunk->error_pos) {
+        error_at(chunk->error_pos, "%s", chunk->error_msg);
+    }
+    if (chunk->end == lex_end) {
+        add_token(&chunk->tokens, TK_EOF, lex_end, 0);
+        lex_pos = NULL;
+    }
+    else {
+        lex_pos = chunk->end;
+    }
+    flush_chunk(chunk);
+    free(chunk);
+    return true;
 }
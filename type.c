@@ -1,9 +1,19 @@
 #include "rehabcc.h"
 
 static struct type *new_type(enum basic_type bt)
+{
+    struct type *type = arena_alloc(sizeof(struct type));
+    type->bt = bt;
+    return type;
+}
+
+// 基本型は一度だけ作って使い回すので、解放しない領域に置く
+static struct type *new_basic_type(enum basic_type bt, int nbyte, int align)
 {
     struct type *type = calloc(1, sizeof(struct type));
     type->bt = bt;
+    type->nbyte = nbyte;
+    type->align = align;
     return type;
 }
 
@@ -11,8 +21,7 @@ struct type *void_type(void)
 {
     static struct type *type = NULL;
     if (!type) {
-        type = new_type(T_VOID);
-        type->nbyte = 0;
+        type = new_basic_type(T_VOID, 0, 1);
     }
     return type;
 }
@@ -21,8 +30,7 @@ struct type *char_type(void)
 {
     static struct type *type = NULL;
     if (!type) {
-        type = new_type(T_CHAR);
-        type->nbyte = 1;
+        type = new_basic_type(T_CHAR, 1, 1);
     }
     return type;
 }
@@ -31,8 +39,7 @@ struct type *int_type(void)
 {
     static struct type *type = NULL;
     if (!type) {
-        type = new_type(T_INT);
-        type->nbyte = 4;
+        type = new_basic_type(T_INT, 4, 4);
     }
     return type;
 }
@@ -42,6 +49,7 @@ struct type *ptr_type(struct type *ptr_to)
     struct type *type = new_type(T_PTR);
     type->ptr_to = ptr_to;
     type->nbyte = 8;
+    type->align = 8;
     return type;
 }
 
@@ -56,5 +64,6 @@ struct type *array_type(struct type *array_of, int size)
     type->ptr_to = array_of;
     type->array_size = size;
     type->nbyte = array_of->nbyte * size;
+    type->align = array_of->align;
     return type;
 }
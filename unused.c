@@ -0,0 +1,118 @@
+#include "rehabcc.h"
+
+// main と -fexport で指定した関数から呼び出し・参照をたどり、
+// どこからも使われない関数、グローバル変数、文字列リテラルを出力しないようにする
+
+struct reach {
+    struct vector *funcs;   // 到達した関数定義
+    struct vector *globals; // 参照されるグローバル変数
+    bool *strings;          // 参照される文字列リテラル (添字は string_index)
+};
+
+static struct ast *find_func(char *name)
+{
+    struct vector *funcs = get_all_ast();
+    for (int i = 0; i < funcs->size; i++) {
+        struct ast *func = funcs->data[i];
+        if (!strcmp(func->funcname, name)) {
+            return func;
+        }
+    }
+    return NULL;
+}
+
+static void mark_func(struct reach *r, struct ast *func)
+{
+    if (func && !vector_contains(r->funcs, func)) {
+        vector_push_back(r->funcs, func);
+    }
+}
+
+static void mark_global(struct reach *r, struct var *var)
+{
+    if (!vector_contains(r->globals, var)) {
+        vector_push_back(r->globals, var);
+    }
+}
+
+static void mark_refs(struct ast **ast, void *arg)
+{
+    struct reach *r = arg;
+    struct ast *node = *ast;
+    switch (node->kind) {
+    case AST_FUNCALL:
+        mark_func(r, find_func(node->funcname));
+        break;
+    case AST_GVAR:
+        mark_global(r, node->var);
+        break;
+    case AST_STRING:
+        r->strings[node->string_index] = true;
+        break;
+    }
+    walk_ast_children(node, mark_refs, arg);
+}
+
+void remove_unused_symbols(void)
+{
+    struct ast *main_func = find_func("main");
+    if (!main_func) {
+        // main のない翻訳単位では、どの関数が使われるか分からない
+        return;
+    }
+
+    struct reach r = {new_vector(), new_vector(), calloc(string_literals->size + 1, sizeof(bool))};
+    mark_func(&r, main_func);
+    for (int i = 0; i < exported_symbols->size; i++) {
+        mark_func(&r, find_func(exported_symbols->data[i]));
+    }
+    for (struct var *var = get_global_vars(); var; var = var->next) {
+        for (int i = 0; i < exported_symbols->size; i++) {
+            if (!strcmp(exported_symbols->data[i], var->name)) {
+                mark_global(&r, var);
+            }
+        }
+    }
+    // 到達した関数が増えなくなるまで、その本体から参照をたどる
+    for (int i = 0; i < r.funcs->size; i++) {
+        walk_ast_children(r.funcs->data[i], mark_refs, &r);
+    }
+    // 残るグローバル変数の初期値が指す変数と文字列リテラルも残す
+    for (int i = 0; i < r.globals->size; i++) {
+        struct var *var = r.globals->data[i];
+        for (int j = 0; var->relocs && j < var->relocs->size; j++) {
+            struct reloc *reloc = var->relocs->data[j];
+            if (reloc->var) {
+                mark_global(&r, reloc->var);
+            }
+            else {
+                r.strings[reloc->string_index] = true;
+            }
+        }
+    }
+
+    // 関数は元の順序のまま残す
+    struct vector *funcs = get_all_ast();
+    int n = 0;
+    for (int i = 0; i < funcs->size; i++) {
+        if (vector_contains(r.funcs, funcs->data[i])) {
+            funcs->data[n++] = funcs->data[i];
+        }
+    }
+    funcs->size = n;
+
+    struct var *next;
+    for (struct var *var = get_global_vars(); var; var = next) {
+        next = var->next;
+        if (!vector_contains(r.globals, var)) {
+            remove_global_var(var);
+        }
+    }
+
+    // 文字列リテラルは添字で参照されるので、使わないものは NULL にして番号を保つ
+    for (int i = 0; i < string_literals->size; i++) {
+        if (!r.strings[i]) {
+            string_literals->data[i] = NULL;
+        }
+    }
+}
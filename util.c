@@ -1,4 +1,116 @@
+#include "rehabcc.h"
+
 int align(int nbyte, int align)
 {
-    return nbyte + (align - nbyte % 8);
+    return (nbyte + align - 1) / align * align;
+}
+
+// printf と同じ書式で文字列を作る
+char *format(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    char *buf = arena_alloc(len + 1);
+    va_start(ap, fmt);
+    vsnprintf(buf, len + 1, fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+// 小さな領域を大きな塊からまとめて切り出し、塊ごとにまとめて解放する
+// 塊の 1/4 を超える大きさは、その大きさだけの塊を別に確保する
+#define ARENA_CHUNK (64 * 1024)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    char data[];
+};
+
+struct arena {
+    struct arena_chunk *chunks;
+    char *ptr;
+    char *end;
+};
+
+// 解放しない領域 (set_arena(NULL) で選ぶ)
+static struct arena permanent_arena;
+
+static struct arena *current_arena = &permanent_arena;
+
+static char *new_chunk(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk = calloc(1, sizeof(struct arena_chunk) + size);
+    chunk->size = size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    return chunk->data;
+}
+
+void *arena_alloc_in(struct arena *arena, size_t size)
+{
+    size = align(size, 16);
+    if (size > ARENA_LARGE) {
+        return new_chunk(arena, size);
+    }
+    if (arena->end - arena->ptr < size) {
+        arena->ptr = new_chunk(arena, ARENA_CHUNK);
+        arena->end = arena->ptr + ARENA_CHUNK;
+    }
+    void *p = arena->ptr;
+    arena->ptr += size;
+    return p;
+}
+
+// 今の領域から確保する
+void *arena_alloc(size_t size)
+{
+    return arena_alloc_in(current_arena, size);
+}
+
+struct arena *get_arena(void)
+{
+    return current_arena;
+}
+
+struct arena *new_arena(void)
+{
+    return calloc(1, sizeof(struct arena));
+}
+
+// 以降の arena_alloc で使う領域を arena (NULL なら解放しない領域) にして、それまでの領域を返す
+struct arena *set_arena(struct arena *arena)
+{
+    struct arena *prev = current_arena;
+    current_arena = arena ? arena : &permanent_arena;
+    return prev;
+}
+
+// arena から確保したものをすべて解放する。arena はそのまま使い続けられる
+// 標準の大きさの塊は 1 つだけ 0 で埋め直して使い回す
+void clear_arena(struct arena *arena)
+{
+    struct arena_chunk *keep = NULL;
+    struct arena_chunk *next;
+    for (struct arena_chunk *chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        if (!keep && chunk->size == ARENA_CHUNK) {
+            keep = chunk;
+        }
+        else {
+            free(chunk);
+        }
+    }
+    arena->chunks = keep;
+    arena->ptr = NULL;
+    arena->end = NULL;
+    if (keep) {
+        keep->next = NULL;
+        memset(keep->data, 0, ARENA_CHUNK);
+        arena->ptr = keep->data;
+        arena->end = keep->data + ARENA_CHUNK;
+    }
 }
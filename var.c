@@ -3,28 +3,71 @@
 static struct var *locals = NULL;
 static struct var *globals = NULL;
 
-static struct var *add_var(struct var *head, struct token *tok, struct type *type)
+// 現在のスコープ
+static struct scope *scope = NULL;
+
+static struct var *add_var(struct var *head, int tok, struct type *type)
 {
-    struct var *var = calloc(1, sizeof(struct var));
+    struct var *var = arena_alloc(sizeof(struct var));
     var->next = head;
     var->name = copy_token_str(tok);
     var->type = type;
     return var;
 }
 
-static struct var *find_var(struct var *head, struct token *tok)
+static bool match_var(struct var *var, int tok)
+{
+    return strlen(var->name) == token_len(tok) && !memcmp(var->name, token_str(tok), token_len(tok));
+}
+
+static struct var *find_var(struct var *head, int tok)
 {
     for (struct var *var = head; var != NULL; var = var->next) {
-        if (!memcmp(var->name, tok->str, tok->len)) {
+        if (match_var(var, tok)) {
             return var;
         }
     }
     return NULL;
 }
 
+struct scope *new_scope(struct scope *parent)
+{
+    struct scope *sc = arena_alloc(sizeof(struct scope));
+    sc->parent = parent;
+    sc->children = new_vector();
+    sc->vars = new_vector();
+    if (parent) {
+        vector_push_back(parent->children, sc);
+    }
+    return sc;
+}
+
 void clear_local_vars(void)
 {
     locals = NULL;
+    scope = new_scope(NULL);
+}
+
+// 関数の外ではローカル変数を探さない
+void end_local_vars(void)
+{
+    locals = NULL;
+    scope = NULL;
+}
+
+struct scope *get_scope(void)
+{
+    return scope;
+}
+
+void enter_scope(void)
+{
+    scope = new_scope(scope);
+}
+
+void leave_scope(void)
+{
+    scope = scope->parent;
 }
 
 struct var *get_local_vars(void)
@@ -32,22 +75,51 @@ struct var *get_local_vars(void)
     return locals;
 }
 
-struct var *add_local_var(struct token *tok, struct type *type)
+// 変数のオフセットは関数全体をパーズした後 layout_frame() で決める
+struct var *add_local_var(int tok, struct type *type)
 {
-    struct var *var = add_var(locals, tok, type);
-    if (locals) {
-        var->offset = align(locals->offset + type->nbyte, 8);
-    }
-    else {
-        var->offset = align(type->nbyte, 8);
-    }
-    locals = var;
+    locals = add_var(locals, tok, type);
+    vector_push_back(scope->vars, locals);
+    return locals;
+}
+
+// 最適化で使う一時変数を関数 func のスコープ scope に追加する
+struct var *add_temp_var(struct ast *func, struct scope *scope, struct type *type)
+{
+    static int count = 0;
+    struct var *var = arena_alloc(sizeof(struct var));
+    var->name = format(".tmp%d", count++);
+    var->type = type;
+    var->next = func->locals;
+    func->locals = var;
+    vector_push_back(scope->vars, var);
     return var;
 }
 
-struct var *find_local_var(struct token *tok)
+// 現在のスコープから外側に向かって変数を探す
+struct var *find_local_var(int tok)
 {
-    return find_var(locals, tok);
+    for (struct scope *sc = scope; sc != NULL; sc = sc->parent) {
+        for (int i = sc->vars->size - 1; i >= 0; i--) {
+            struct var *var = sc->vars->data[i];
+            if (match_var(var, tok)) {
+                return var;
+            }
+        }
+    }
+    return NULL;
+}
+
+// 現在のスコープで宣言済みの変数を探す
+struct var *find_scope_var(int tok)
+{
+    for (int i = 0; i < scope->vars->size; i++) {
+        struct var *var = scope->vars->data[i];
+        if (match_var(var, tok)) {
+            return var;
+        }
+    }
+    return NULL;
 }
 
 struct var *get_global_vars(void)
@@ -55,13 +127,23 @@ struct var *get_global_vars(void)
     return globals;
 }
 
-struct var *add_global_var(struct token *tok, struct type *type)
+struct var *add_global_var(int tok, struct type *type)
 {
     globals = add_var(globals, tok, type);
     return globals;
 }
 
-struct var *find_global_var(struct token *tok)
+void remove_global_var(struct var *var)
+{
+    for (struct var **p = &globals; *p; p = &(*p)->next) {
+        if (*p == var) {
+            *p = var->next;
+            return;
+        }
+    }
+}
+
+struct var *find_global_var(int tok)
 {
     return find_var(globals, tok);
 }
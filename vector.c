@@ -1,19 +1,37 @@
 #include "rehabcc.h"
 
+// ベクタとその要素の領域は arena_alloc で確保する
+// 要素の領域を広げるときも、ベクタを作ったときと同じ領域から確保する
 struct vector *new_vector(void)
 {
-    struct vector *vec = calloc(1, sizeof(struct vector));
-    vec->data = calloc(16, sizeof(void *));
+    struct vector *vec = arena_alloc(sizeof(struct vector));
+    vec->data = vec->small;
     vec->size = 0;
-    vec->cap = 16;
+    vec->cap = VECTOR_SMALL;
+    vec->arena = get_arena();
     return vec;
 }
 
 void vector_push_back(struct vector *vec, void *data)
 {
     if (vec->size == vec->cap) {
+        // 倍々に広げる。古い領域は領域ごと解放されるまでそのまま残す
+        int nbyte = sizeof(void *) * vec->cap;
+        void **new_data = arena_alloc_in(vec->arena, 2 * nbyte);
+        memcpy(new_data, vec->data, nbyte);
+        vec->data = new_data;
         vec->cap *= 2;
-        vec->data = realloc(vec->data, vec->cap);
     }
     vec->data[vec->size++] = data;
 }
+
+// vec が p を要素に持つかどうか
+bool vector_contains(struct vector *vec, void *p)
+{
+    for (int i = 0; i < vec->size; i++) {
+        if (vec->data[i] == p) {
+            return true;
+        }
+    }
+    return false;
+}
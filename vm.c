@@ -0,0 +1,755 @@
+#include "rehabcc.h"
+
+// -run で使うバックエンド
+// 構文木をレジスタマシンのバイトコードに変換し、アセンブラやリンカを通さずにその場で実行する
+// 命令の振り分けは命令ごとに飛び先を引く threaded code (GCC の computed goto) で行う
+
+enum opcode {
+    OP_MOVI,  // a = b (即値)
+    OP_LOADK, // a = consts[b]
+    OP_MOV,   // a = b
+    OP_EXT8,  // a = b の下位 8 bit を符号拡張した値
+    OP_EXT32, // a = b の下位 32 bit を符号拡張した値
+    OP_LOCAL, // a = フレームの先頭 + b
+    OP_LD8,   // a = *(char *)b
+    OP_LD32,  // a = *(int *)b
+    OP_LD64,  // a = *(long *)b
+    OP_ST8,   // *(char *)a = b
+    OP_ST32,  // *(int *)a = b
+    OP_ST64,  // *(long *)a = b
+    OP_ADD,   // a = b + c
+    OP_SUB,   // a = b - c
+    OP_MUL,   // a = b * c
+    OP_MULI,  // a = b * c (即値)
+    OP_DIV,   // a = b / c
+    OP_EQ,    // a = b == c
+    OP_NE,    // a = b != c
+    OP_LT,    // a = b < c
+    OP_LE,    // a = b <= c
+    OP_JMP,   // a 番目の命令に飛ぶ
+    OP_JZ,    // a == 0 なら b 番目の命令に飛ぶ
+    OP_CALL,  // a = funcs[b](c, c + 1, ..., c + n - 1)
+    OP_CALLH, // a = host_funcs[b](c, c + 1, ..., c + n - 1)
+    OP_TAIL,  // 今のフレームを再利用して funcs[b](c, c + 1, ..., c + n - 1) に移る
+    OP_RET,   // a を返す
+};
+
+// 命令。a, b, c はレジスタ番号、即値、飛び先のいずれか
+struct inst {
+    unsigned char op;
+    unsigned char n; // 呼び出しの引数の個数
+    int a;
+    int b;
+    int c;
+};
+
+// 変換した関数
+// レジスタ 0 から n - 1 に引数を受け取る
+struct vm_func {
+    struct ast *func;
+    int entry;      // 先頭の命令の位置
+    int nregs;      // 使うレジスタの数
+    int frame_size; // メモリ上に置く変数の領域の大きさ
+};
+
+// 実行中のプログラムから呼び出せるホスト側の関数
+static long host_alloc4(long x1, long x2, long x3, long x4)
+{
+    int *x = calloc(4, sizeof(int));
+    x[0] = x1;
+    x[1] = x2;
+    x[2] = x3;
+    x[3] = x4;
+    return (long)x;
+}
+
+struct host_func {
+    char *name;
+    void *fn;
+    bool variadic; // printf のように書式文字列に続けて可変個の引数をとる
+};
+
+static struct host_func host_funcs[] = {
+    {"alloc4", host_alloc4},
+    {"printf", printf, true},
+    {"puts", puts},
+    {"putchar", putchar},
+    {"malloc", malloc},
+    {"calloc", calloc},
+    {"free", free},
+    {"exit", exit},
+    {NULL},
+};
+
+typedef long (*host_fn)(long, long, long, long, long, long);
+// 可変長引数の関数は、浮動小数点数の引数の個数 (al) を渡す呼び出し方で呼ぶ必要がある
+typedef int (*host_variadic_fn)(const char *, ...);
+
+static struct inst *insts;
+static int ninsts;
+static int insts_cap;
+
+// 64 bit の定数 (グローバル変数や文字列のアドレス)
+static long *consts;
+static int nconsts;
+static int consts_cap;
+
+static struct vm_func *funcs;
+static int nfuncs;
+
+// グローバル変数の実体
+static struct vector *global_vars;
+static struct vector *global_mems;
+
+// 変換中の関数
+struct lower {
+    struct vm_func *vf;
+    struct vector *addr_taken;
+    int nvars;
+    struct var **vars; // func->locals の変数と、その置き場所
+    int *regs;         // レジスタに置く場合はレジスタ番号、そうでなければ -1
+    int *offsets;      // メモリに置く場合のフレーム先頭からのオフセット
+    int ntemps;        // 使用中のレジスタの数
+    int inline_dst;    // 展開された呼び出しの戻り値を入れるレジスタ (-1 なら関数本体の直下)
+    struct vector *inline_exits; // 展開された呼び出しの出口に飛ぶ命令の位置
+    bool tail_calls;   // return f(...) でフレームを再利用してよい
+};
+
+static int emit(int op, int a, int b, int c)
+{
+    if (ninsts == insts_cap) {
+        insts_cap = insts_cap ? insts_cap * 2 : 256;
+        insts = realloc(insts, sizeof(struct inst) * insts_cap);
+    }
+    insts[ninsts] = (struct inst){op, 0, a, b, c};
+    return ninsts++;
+}
+
+static int add_const(long val)
+{
+    if (nconsts == consts_cap) {
+        consts_cap = consts_cap ? consts_cap * 2 : 64;
+        consts = realloc(consts, sizeof(long) * consts_cap);
+    }
+    consts[nconsts] = val;
+    return nconsts++;
+}
+
+static int new_temp(struct lower *l)
+{
+    int r = l->ntemps++;
+    if (l->vf->nregs < l->ntemps) {
+        l->vf->nregs = l->ntemps;
+    }
+    return r;
+}
+
+static int find_var(struct lower *l, struct var *var)
+{
+    for (int i = 0; i < l->nvars; i++) {
+        if (l->vars[i] == var) {
+            return i;
+        }
+    }
+    error("変数が見つかりません: %s", var->name);
+    return -1;
+}
+
+static long global_addr(struct var *var)
+{
+    for (int i = 0; i < global_vars->size; i++) {
+        if (global_vars->data[i] == var) {
+            return (long)global_mems->data[i];
+        }
+    }
+    error("グローバル変数が見つかりません: %s", var->name);
+    return 0;
+}
+
+static int load_op(struct type *type)
+{
+    return type->bt == T_CHAR ? OP_LD8 : type->bt == T_INT ? OP_LD32 : OP_LD64;
+}
+
+static int store_op(struct type *type)
+{
+    return type->bt == T_CHAR ? OP_ST8 : type->bt == T_INT ? OP_ST32 : OP_ST64;
+}
+
+// メモリ上の変数に書き込んで読み出したときと同じ値にする
+static int extend_op(struct type *type)
+{
+    return type->bt == T_CHAR ? OP_EXT8 : type->bt == T_INT ? OP_EXT32 : OP_MOV;
+}
+
+static void find_assign(struct ast **ast, void *found)
+{
+    if ((*ast)->kind == AST_ASSIGN || (*ast)->kind == AST_INLINE) {
+        *(bool *)found = true;
+    }
+    else {
+        walk_ast_children(*ast, find_assign, found);
+    }
+}
+
+// 式の評価中に変数を書き換えうるかどうか
+static bool writes_var(struct ast *ast)
+{
+    bool found = ast->kind == AST_ASSIGN || ast->kind == AST_INLINE;
+    walk_ast_children(ast, find_assign, &found);
+    return found;
+}
+
+static int lower_expr(struct lower *l, struct ast *node);
+static void lower_stmt(struct lower *l, struct ast *node);
+
+// 左辺値のアドレスを入れたレジスタを返す
+static int lower_lval(struct lower *l, struct ast *node)
+{
+    int r;
+    switch (node->kind) {
+    case AST_LVAR: {
+        int i = find_var(l, node->var);
+        r = new_temp(l);
+        emit(OP_LOCAL, r, l->offsets[i], 0);
+        return r;
+    }
+    case AST_GVAR:
+        r = new_temp(l);
+        emit(OP_LOADK, r, add_const(global_addr(node->var)), 0);
+        return r;
+    case AST_DEREF:
+        return lower_expr(l, node->lhs);
+    }
+    error("左辺値ではありません");
+    return -1;
+}
+
+// tail が true なら、定義のある関数は今のフレームを再利用して呼び出す (値は返さない)
+static int lower_call(struct lower *l, struct ast *node, bool tail)
+{
+    int nargs = node->params->size;
+    if (nargs > 6) {
+        error("引数が多すぎます: %s", node->funcname);
+    }
+    // 後の引数の評価で書き換えられないよう、評価した値をすぐに引数の並びに移す
+    int args = l->ntemps;
+    for (int i = 0; i < nargs; i++) {
+        new_temp(l);
+    }
+    for (int i = 0; i < nargs; i++) {
+        int r = lower_expr(l, node->params->data[i]);
+        emit(OP_MOV, args + i, r, 0);
+    }
+
+    int dst = new_temp(l);
+    for (int i = 0; i < nfuncs; i++) {
+        if (!strcmp(funcs[i].func->funcname, node->funcname)) {
+            insts[emit(tail ? OP_TAIL : OP_CALL, dst, i, args)].n = nargs;
+            return dst;
+        }
+    }
+    for (int i = 0; host_funcs[i].name; i++) {
+        if (!strcmp(host_funcs[i].name, node->funcname)) {
+            insts[emit(OP_CALLH, dst, i, args)].n = nargs;
+            return dst;
+        }
+    }
+    error("未定義の関数です: %s", node->funcname);
+    return -1;
+}
+
+// 式の値を入れたレジスタを返す
+// レジスタに置いた変数の参照はそのレジスタを返すので、書き換えてはいけない
+static int lower_expr(struct lower *l, struct ast *node)
+{
+    int r;
+    switch (node->kind) {
+    case AST_NUM:
+        r = new_temp(l);
+        emit(OP_MOVI, r, node->val, 0);
+        return r;
+    case AST_LVAR: {
+        int i = find_var(l, node->var);
+        if (l->regs[i] >= 0) {
+            return l->regs[i];
+        }
+        r = lower_lval(l, node);
+        if (node->type->bt != T_ARRAY) {
+            emit(load_op(node->type), r, r, 0);
+        }
+        return r;
+    }
+    case AST_GVAR:
+        r = lower_lval(l, node);
+        if (node->type->bt != T_ARRAY) {
+            emit(load_op(node->type), r, r, 0);
+        }
+        return r;
+    case AST_STRING:
+        r = new_temp(l);
+        emit(OP_LOADK, r, add_const((long)string_literals->data[node->string_index]), 0);
+        return r;
+    case AST_ASSIGN: {
+        // 代入式の値は、左辺の型に切り詰める前の右辺値
+        if (node->lhs->kind == AST_LVAR) {
+            int i = find_var(l, node->lhs->var);
+            if (l->regs[i] >= 0) {
+                r = lower_expr(l, node->rhs);
+                emit(extend_op(node->lhs->type), l->regs[i], r, 0);
+                return r;
+            }
+        }
+        int addr = lower_lval(l, node->lhs);
+        r = lower_expr(l, node->rhs);
+        emit(store_op(node->lhs->type), addr, r, 0);
+        return r;
+    }
+    case AST_ADDR:
+        return lower_lval(l, node->lhs);
+    case AST_DEREF:
+        r = lower_expr(l, node->lhs);
+        if (node->type->bt != T_ARRAY) {
+            int dst = new_temp(l);
+            emit(load_op(node->type), dst, r, 0);
+            return dst;
+        }
+        return r;
+    case AST_FUNCALL:
+        return lower_call(l, node, false);
+    case AST_INLINE: {
+        // 本体中の return は戻り値をレジスタに入れて出口に飛んでくる
+        int saved_dst = l->inline_dst;
+        struct vector *saved_exits = l->inline_exits;
+        l->inline_dst = new_temp(l);
+        l->inline_exits = new_vector();
+        for (int i = 0; i < node->stmts->size; i++) {
+            lower_stmt(l, node->stmts->data[i]);
+        }
+        for (int i = 0; i < l->inline_exits->size; i++) {
+            insts[(long)l->inline_exits->data[i]].a = ninsts;
+        }
+        r = l->inline_dst;
+        l->inline_dst = saved_dst;
+        l->inline_exits = saved_exits;
+        return r;
+    }
+    case AST_VLOOP:
+        error("ベクトル化したループはバイトコードにできません");
+    }
+
+    int lhs = lower_expr(l, node->lhs);
+    if (node->lhs->kind == AST_LVAR && writes_var(node->rhs)) {
+        // 右辺で書き換えられる前の値を使う
+        int t = new_temp(l);
+        emit(OP_MOV, t, lhs, 0);
+        lhs = t;
+    }
+    int rhs = lower_expr(l, node->rhs);
+    r = new_temp(l);
+    switch (node->kind) {
+    case AST_ADD:
+        emit(OP_ADD, r, lhs, rhs);
+        break;
+    case AST_SUB:
+        emit(OP_SUB, r, lhs, rhs);
+        break;
+    case AST_MUL:
+        emit(OP_MUL, r, lhs, rhs);
+        break;
+    case AST_DIV:
+        emit(OP_DIV, r, lhs, rhs);
+        break;
+    case AST_EQ:
+        emit(OP_EQ, r, lhs, rhs);
+        break;
+    case AST_NE:
+        emit(OP_NE, r, lhs, rhs);
+        break;
+    case AST_LT:
+        emit(OP_LT, r, lhs, rhs);
+        break;
+    case AST_LE:
+        emit(OP_LE, r, lhs, rhs);
+        break;
+    case AST_ADD_PTR:
+        emit(OP_MULI, r, rhs, node->type->ptr_to->nbyte);
+        emit(OP_ADD, r, lhs, r);
+        break;
+    default:
+        error("バイトコードにできない式です");
+    }
+    return r;
+}
+
+// 文の途中で使ったレジスタは文の終わりで解放する
+static void lower_stmt(struct lower *l, struct ast *node)
+{
+    int saved = l->ntemps;
+    switch (node->kind) {
+    case AST_RETURN: {
+        // 呼び出し先が OP_TAIL にならなかった場合は普通に値を返す
+        bool tail = l->tail_calls && l->inline_dst < 0 && node->lhs->kind == AST_FUNCALL;
+        int r = tail ? lower_call(l, node->lhs, true) : lower_expr(l, node->lhs);
+        if (l->inline_dst >= 0) {
+            emit(OP_MOV, l->inline_dst, r, 0);
+            vector_push_back(l->inline_exits, (void *)(long)emit(OP_JMP, 0, 0, 0));
+        }
+        else {
+            emit(OP_RET, r, 0, 0);
+        }
+        break;
+    }
+    case AST_IF: {
+        int jz = emit(OP_JZ, lower_expr(l, node->cond), 0, 0);
+        l->ntemps = saved;
+        lower_stmt(l, node->then);
+        if (node->els) {
+            int jmp = emit(OP_JMP, 0, 0, 0);
+            insts[jz].b = ninsts;
+            lower_stmt(l, node->els);
+            insts[jmp].a = ninsts;
+        }
+        else {
+            insts[jz].b = ninsts;
+        }
+        break;
+    }
+    case AST_WHILE: {
+        int begin = ninsts;
+        int jz = emit(OP_JZ, lower_expr(l, node->cond), 0, 0);
+        l->ntemps = saved;
+        lower_stmt(l, node->stmt);
+        emit(OP_JMP, begin, 0, 0);
+        insts[jz].b = ninsts;
+        break;
+    }
+    case AST_FOR: {
+        if (node->init) {
+            lower_stmt(l, node->init);
+        }
+        int begin = ninsts;
+        int jz = -1;
+        if (node->cond) {
+            jz = emit(OP_JZ, lower_expr(l, node->cond), 0, 0);
+            l->ntemps = saved;
+        }
+        lower_stmt(l, node->stmt);
+        if (node->update) {
+            lower_stmt(l, node->update);
+        }
+        emit(OP_JMP, begin, 0, 0);
+        if (jz >= 0) {
+            insts[jz].b = ninsts;
+        }
+        break;
+    }
+    case AST_BLOCK:
+        for (int i = 0; i < node->stmts->size; i++) {
+            lower_stmt(l, node->stmts->data[i]);
+        }
+        break;
+    case AST_VARDECL:
+        break;
+    default:
+        lower_expr(l, node);
+        break;
+    }
+    l->ntemps = saved;
+}
+
+// 仮引数はレジスタ 0 から順に受け取り、その後ろにレジスタに置く変数を並べる
+// アドレスを取られる変数と配列はフレーム上に置く
+static void lower_function(struct vm_func *vf)
+{
+    struct ast *func = vf->func;
+    struct lower l = {vf, addr_taken_vars(func)};
+    l.inline_dst = -1;
+    // ローカル変数のアドレスが呼び出し先に渡りうる関数では、フレームを再利用できない
+    l.tail_calls = sibling_calls && !takes_local_addr(func);
+    for (struct var *var = func->locals; var; var = var->next) {
+        l.nvars++;
+    }
+    l.vars = calloc(l.nvars, sizeof(struct var *));
+    l.regs = calloc(l.nvars, sizeof(int));
+    l.offsets = calloc(l.nvars, sizeof(int));
+
+    int i = 0;
+    for (struct var *var = func->locals; var; var = var->next, i++) {
+        l.vars[i] = var;
+        l.regs[i] = -1;
+    }
+    l.ntemps = func->params->size;
+    for (i = 0; i < l.nvars; i++) {
+        struct var *var = l.vars[i];
+        bool in_mem = var->type->bt == T_ARRAY;
+        for (int j = 0; j < l.addr_taken->size; j++) {
+            in_mem |= l.addr_taken->data[j] == var;
+        }
+        if (in_mem) {
+            vf->frame_size = align(vf->frame_size, var->type->align);
+            l.offsets[i] = vf->frame_size;
+            vf->frame_size += var->type->nbyte;
+            continue;
+        }
+        l.regs[i] = -2; // 仮引数でなければ後で割り当てる
+        for (int j = 0; j < func->params->size; j++) {
+            if (func->params->data[j] == var) {
+                l.regs[i] = j;
+            }
+        }
+        if (l.regs[i] == -2) {
+            l.regs[i] = new_temp(&l);
+        }
+    }
+    vf->frame_size = align(vf->frame_size, 16);
+    if (vf->nregs < l.ntemps) {
+        vf->nregs = l.ntemps;
+    }
+
+    vf->entry = ninsts;
+    for (int j = 0; j < func->params->size; j++) {
+        int k = find_var(&l, func->params->data[j]);
+        struct type *type = l.vars[k]->type;
+        if (l.regs[k] >= 0) {
+            emit(extend_op(type), j, j, 0);
+        }
+        else {
+            int t = new_temp(&l);
+            emit(OP_LOCAL, t, l.offsets[k], 0);
+            emit(store_op(type), t, j, 0);
+            l.ntemps--;
+        }
+    }
+    for (int j = 0; j < func->stmts->size; j++) {
+        lower_stmt(&l, func->stmts->data[j]);
+    }
+    // return せずに本体の終わりに達した場合
+    int r = new_temp(&l);
+    emit(OP_MOVI, r, 0, 0);
+    emit(OP_RET, r, 0, 0);
+}
+
+// 実行時のスタック
+#define REG_STACK_SIZE (1 << 20)
+#define MEM_STACK_SIZE (8 << 20)
+#define CALL_STACK_SIZE (1 << 16)
+
+struct call_frame {
+    struct inst *ret_pc;
+    long *regs;
+    char *fp;
+    struct vm_func *func;
+    int dst;
+};
+
+static long execute(struct vm_func *entry)
+{
+    static void *dispatch[] = {
+        [OP_MOVI] = &&op_movi,   [OP_LOADK] = &&op_loadk, [OP_MOV] = &&op_mov,     [OP_EXT8] = &&op_ext8,
+        [OP_EXT32] = &&op_ext32, [OP_LOCAL] = &&op_local, [OP_LD8] = &&op_ld8,     [OP_LD32] = &&op_ld32,
+        [OP_LD64] = &&op_ld64,   [OP_ST8] = &&op_st8,     [OP_ST32] = &&op_st32,   [OP_ST64] = &&op_st64,
+        [OP_ADD] = &&op_add,     [OP_SUB] = &&op_sub,     [OP_MUL] = &&op_mul,     [OP_MULI] = &&op_muli,
+        [OP_DIV] = &&op_div,     [OP_EQ] = &&op_eq,       [OP_NE] = &&op_ne,       [OP_LT] = &&op_lt,
+        [OP_LE] = &&op_le,       [OP_JMP] = &&op_jmp,     [OP_JZ] = &&op_jz,       [OP_CALL] = &&op_call,
+        [OP_CALLH] = &&op_callh, [OP_TAIL] = &&op_tail,   [OP_RET] = &&op_ret,
+    };
+
+    long *reg_stack = calloc(REG_STACK_SIZE, sizeof(long));
+    char *mem_stack = calloc(MEM_STACK_SIZE, 1);
+    struct call_frame *frames = calloc(CALL_STACK_SIZE, sizeof(struct call_frame));
+    int nframes = 0;
+
+    struct vm_func *func = entry;
+    long *r = reg_stack;
+    char *fp = mem_stack;
+    struct inst *pc = insts + entry->entry;
+
+#define DISPATCH() goto *dispatch[pc->op]
+#define NEXT()      \
+    do {            \
+        pc++;       \
+        DISPATCH(); \
+    } while (0)
+
+    DISPATCH();
+
+op_movi:
+    r[pc->a] = pc->b;
+    NEXT();
+op_loadk:
+    r[pc->a] = consts[pc->b];
+    NEXT();
+op_mov:
+    r[pc->a] = r[pc->b];
+    NEXT();
+op_ext8:
+    r[pc->a] = (signed char)r[pc->b];
+    NEXT();
+op_ext32:
+    r[pc->a] = (int)r[pc->b];
+    NEXT();
+op_local:
+    r[pc->a] = (long)(fp + pc->b);
+    NEXT();
+op_ld8:
+    r[pc->a] = *(signed char *)r[pc->b];
+    NEXT();
+op_ld32:
+    r[pc->a] = *(int *)r[pc->b];
+    NEXT();
+op_ld64:
+    r[pc->a] = *(long *)r[pc->b];
+    NEXT();
+op_st8:
+    *(char *)r[pc->a] = r[pc->b];
+    NEXT();
+op_st32:
+    *(int *)r[pc->a] = r[pc->b];
+    NEXT();
+op_st64:
+    *(long *)r[pc->a] = r[pc->b];
+    NEXT();
+op_add:
+    r[pc->a] = (unsigned long)r[pc->b] + r[pc->c];
+    NEXT();
+op_sub:
+    r[pc->a] = (unsigned long)r[pc->b] - r[pc->c];
+    NEXT();
+op_mul:
+    r[pc->a] = (unsigned long)r[pc->b] * r[pc->c];
+    NEXT();
+op_muli:
+    r[pc->a] = (unsigned long)r[pc->b] * pc->c;
+    NEXT();
+op_div:
+    r[pc->a] = r[pc->b] / r[pc->c];
+    NEXT();
+op_eq:
+    r[pc->a] = r[pc->b] == r[pc->c];
+    NEXT();
+op_ne:
+    r[pc->a] = r[pc->b] != r[pc->c];
+    NEXT();
+op_lt:
+    r[pc->a] = r[pc->b] < r[pc->c];
+    NEXT();
+op_le:
+    r[pc->a] = r[pc->b] <= r[pc->c];
+    NEXT();
+op_jmp:
+    pc = insts + pc->a;
+    DISPATCH();
+op_jz:
+    if (r[pc->a]) {
+        NEXT();
+    }
+    pc = insts + pc->b;
+    DISPATCH();
+op_call: {
+    struct vm_func *callee = &funcs[pc->b];
+    long *regs = r + func->nregs;
+    char *callee_fp = fp + func->frame_size;
+    if (nframes == CALL_STACK_SIZE || reg_stack + REG_STACK_SIZE < regs + callee->nregs ||
+        mem_stack + MEM_STACK_SIZE < callee_fp + callee->frame_size) {
+        error("スタックが溢れました: %s", callee->func->funcname);
+    }
+    for (int i = 0; i < pc->n; i++) {
+        regs[i] = r[pc->c + i];
+    }
+    frames[nframes++] = (struct call_frame){pc + 1, r, fp, func, pc->a};
+    func = callee;
+    r = regs;
+    fp = callee_fp;
+    pc = insts + callee->entry;
+    DISPATCH();
+}
+op_callh: {
+    long a[6] = {0};
+    for (int i = 0; i < pc->n; i++) {
+        a[i] = r[pc->c + i];
+    }
+    struct host_func *h = &host_funcs[pc->b];
+    if (h->variadic) {
+        r[pc->a] = ((host_variadic_fn)h->fn)((const char *)a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+    else {
+        r[pc->a] = ((host_fn)h->fn)(a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+    NEXT();
+}
+op_tail: {
+    struct vm_func *callee = &funcs[pc->b];
+    if (reg_stack + REG_STACK_SIZE < r + callee->nregs || mem_stack + MEM_STACK_SIZE < fp + callee->frame_size) {
+        error("スタックが溢れました: %s", callee->func->funcname);
+    }
+    for (int i = 0; i < pc->n; i++) {
+        r[i] = r[pc->c + i];
+    }
+    func = callee;
+    pc = insts + callee->entry;
+    DISPATCH();
+}
+op_ret: {
+    long val = r[pc->a];
+    if (nframes == 0) {
+        free(reg_stack);
+        free(mem_stack);
+        free(frames);
+        return val;
+    }
+    struct call_frame *f = &frames[--nframes];
+    pc = f->ret_pc;
+    r = f->regs;
+    fp = f->fp;
+    func = f->func;
+    r[f->dst] = val;
+    DISPATCH();
+}
+#undef NEXT
+#undef DISPATCH
+}
+
+int run_program(void)
+{
+    global_vars = new_vector();
+    global_mems = new_vector();
+    for (struct var *var = get_global_vars(); var; var = var->next) {
+        vector_push_back(global_vars, var);
+        vector_push_back(global_mems, calloc(1, var->type->nbyte + 1));
+    }
+    // 初期値を書き込み、アドレスを置く場所には他の変数や文字列リテラルの実際のアドレスを置く
+    for (int i = 0; i < global_vars->size; i++) {
+        struct var *var = global_vars->data[i];
+        char *mem = global_mems->data[i];
+        if (var->init_data) {
+            memcpy(mem, var->init_data, var->type->nbyte);
+        }
+        for (int j = 0; var->relocs && j < var->relocs->size; j++) {
+            struct reloc *reloc = var->relocs->data[j];
+            long addr = reloc->var ? global_addr(reloc->var) : (long)string_literals->data[reloc->string_index];
+            addr += reloc->addend;
+            memcpy(mem + reloc->offset, &addr, 8);
+        }
+    }
+
+    struct vector *asts = get_all_ast();
+    nfuncs = asts->size;
+    funcs = calloc(nfuncs, sizeof(struct vm_func));
+    struct vm_func *main_func = NULL;
+    for (int i = 0; i < nfuncs; i++) {
+        funcs[i].func = asts->data[i];
+        if (!strcmp(funcs[i].func->funcname, "main")) {
+            main_func = &funcs[i];
+        }
+    }
+    if (!main_func) {
+        error("main 関数がありません");
+    }
+    for (int i = 0; i < nfuncs; i++) {
+        lower_function(&funcs[i]);
+    }
+
+    // main の引数は渡さない
+    return execute(main_func);
+}